@@ -5,12 +5,30 @@
 #include "vk_layer.h"
 
 #include "primus_vk_dispatch_table.h"
+#include "primus_vk_copy_pool.h"
+#include "primus_vk_pacing.h"
+#include "primus_vk_placement.h"
+#include "primus_vk_present_ring.h"
+#include "primus_vk_spares.h"
+#include "primus_vk_telemetry.h"
+#include "primus_vk_tracer.h"
+// The compute shaders for dirty tiles and the YUV transfer, left out when
+// the layer is built without glslangValidator.
+#ifdef PRIMUS_VK_SHADERS
+#include "primus_vk_dirty.comp.h"
+#include "primus_vk_yuv_decode.comp.h"
+#include "primus_vk_yuv_encode.comp.h"
+const bool compute_shaders = true;
+#else
+const bool compute_shaders = false;
+#endif
 
 #include <cassert>
 #include <cstring>
 
 #include <mutex>
 #include <condition_variable>
+#include <deque>
 #include <map>
 #include <vector>
 #include <list>
@@ -52,19 +70,30 @@ void *&GetKey(DispatchableType inst)
 }
 
 class CreateOtherDevice;
+bool hasTimelineSemaphores(const CreateOtherDevice &cod, VkDevice device);
 
 // #define TRACE(x)
 #define TRACE(x) std::cerr << "PrimusVK: " << x << "\n";
 #define TRACE_PROFILING(x)
 // #define TRACE_PROFILING(x) std::cout << "PrimusVK: " << x << "\n";
-#define TRACE_PROFILING_EVENT(x, y)
-// #define TRACE_PROFILING_EVENT(idx, evt) std::cout << "PrimusVK-profiling: " << idx << " " << std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - primus_start).count() << " " << evt << "\n";
+// Recorded by the tracer when PRIMUS_VK_TRACE is set, see primus_vk_tracer.h.
+#define TRACE_PROFILING_EVENT(idx, evt) TRACE_INSTANT(evt, idx)
 #define TRACE_FRAME(x)
 // #define TRACE_FRAME(x) std::cout << "PrimusVK: " << x << "\n";
 
 #define VK_CHECK_RESULT(x) do{ const VkResult r = x; if(r != VK_SUCCESS){printf("PrimusVK: Error %d in line %d.\n", r, __LINE__);}}while(0);
 // #define VK_CHECK_RESULT(x) if(x != VK_SUCCESS){printf("Error %d, in %d\n", x, __LINE__);}
 
+// Refresh rate of the virtual display in Hz (PRIMUS_VK_VIRTUAL_DISPLAY),
+// 0 for no refresh limit, -1 if frames go to a real display.
+double virtualDisplayRefresh(){
+  static const double refresh = [](){
+    const char *env = getenv("PRIMUS_VK_VIRTUAL_DISPLAY");
+    return env != nullptr && *env != 0 ? std::max(0.0, std::stod(std::string{env})) : -1.0;
+  }();
+  return refresh;
+}
+
 struct InstanceInfo {
 public:
   VkInstance instance;
@@ -176,6 +205,17 @@ public:
 	break;
       }
     }
+    if(virtualDisplayRefresh() >= 0 && !physicalDevices.empty()){
+      // Nothing is shown, so a single device, software renderers like
+      // lavapipe included, can take both roles.
+      if(render == VK_NULL_HANDLE){
+	render = display != VK_NULL_HANDLE ? display : physicalDevices[0];
+      }
+      if(display == VK_NULL_HANDLE){
+	display = render;
+      }
+      TRACE("Virtual display, rendering on " << render << ", uploading on " << display);
+    }
     if(display == VK_NULL_HANDLE || render == VK_NULL_HANDLE){
       const auto c_icd_filenames = getenv("VK_ICD_FILENAMES");
       if(display == VK_NULL_HANDLE) {
@@ -296,23 +336,260 @@ void VKAPI_CALL PrimusVK_DestroyInstance(VkInstance instance, const VkAllocation
   instance_info.erase(instance_key);
 }
 
-struct FramebufferImage;
+// Sub-allocates the layer's images and buffers on one device from a few
+// large blocks per memory type instead of one VkDeviceMemory each.
+// Host-visible blocks are mapped once for their whole lifetime. Released
+// ranges go back to the block's free list and are reused by the next
+// swapchain, empty blocks are kept until a second one of the same type is
+// empty. PRIMUS_VK_ARENA_BLOCK_MB sets the block size (default 64).
+// Images and buffers the driver wants a dedicated allocation for get a
+// block of their own, which is freed with them.
+class MemoryArena {
+public:
+  struct Block {
+    VkDeviceMemory mem;
+    uint32_t type;
+    VkDeviceSize size;
+    // Null unless the memory type is host visible.
+    char *data = nullptr;
+    VkDeviceSize used = 0;
+    // Holds one dedicated allocation, never shared.
+    bool dedicated = false;
+    // Offset -> size of the unused ranges, neighbours are always merged.
+    std::map<VkDeviceSize, VkDeviceSize> unused;
+  };
+  struct Allocation {
+    Block *block = nullptr;
+    VkDeviceSize offset = 0;
+    VkDeviceSize size = 0;
+  };
+private:
+  VkDevice device;
+  VkPhysicalDeviceMemoryProperties mem_props;
+  // Every range starts and ends on this, so images and buffers never share
+  // a bufferImageGranularity page, and invalidating a host range never
+  // touches a neighbour.
+  VkDeviceSize granularity;
+  VkDeviceSize host_granularity;
+  VkDeviceSize block_size = VkDeviceSize{64} << 20;
+  std::mutex mutex;
+  std::list<Block> blocks;
+
+  static VkDeviceSize roundUp(VkDeviceSize value, VkDeviceSize alignment){
+    return (value + alignment - 1) / alignment * alignment;
+  }
+  bool isHostVisible(uint32_t type) const {
+    return (mem_props.memoryTypes[type].propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) != 0;
+  }
+  bool carve(Block &block, VkDeviceSize size, VkDeviceSize alignment, Allocation &allocation){
+    for(auto it = block.unused.begin(); it != block.unused.end(); ++it){
+      const VkDeviceSize rangeStart = it->first;
+      const VkDeviceSize rangeEnd = it->first + it->second;
+      const VkDeviceSize start = roundUp(rangeStart, alignment);
+      if(start + size > rangeEnd){
+	continue;
+      }
+      block.unused.erase(it);
+      if(start > rangeStart){
+	block.unused[rangeStart] = start - rangeStart;
+      }
+      if(start + size < rangeEnd){
+	block.unused[start + size] = rangeEnd - start - size;
+      }
+      block.used += size;
+      allocation = Allocation{&block, start, size};
+      return true;
+    }
+    return false;
+  }
+  Block *addBlock(uint32_t type, VkDeviceSize minSize, const VkMemoryDedicatedAllocateInfo *dedicated = nullptr){
+    auto &dispatch = device_dispatch[GetKey(device)];
+    VkMemoryAllocateInfo memAllocInfo {.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO};
+    memAllocInfo.pNext = dedicated;
+    memAllocInfo.memoryTypeIndex = type;
+    memAllocInfo.allocationSize = dedicated != nullptr ? minSize : std::max(block_size, minSize);
+    VkDeviceMemory mem;
+    VkResult res = dispatch.AllocateMemory(device, &memAllocInfo, nullptr, &mem);
+    if(res != VK_SUCCESS && memAllocInfo.allocationSize > minSize){
+      // The heap may still fit the range on its own.
+      memAllocInfo.allocationSize = minSize;
+      res = dispatch.AllocateMemory(device, &memAllocInfo, nullptr, &mem);
+    }
+    if(res != VK_SUCCESS){
+      TRACE("ERROR, allocating " << memAllocInfo.allocationSize << " bytes of memory type " << type << " failed: " << res);
+      throw std::runtime_error("Memory allocation failed");
+    }
+    blocks.emplace_back();
+    Block &block = blocks.back();
+    block.mem = mem;
+    block.type = type;
+    block.size = memAllocInfo.allocationSize;
+    block.dedicated = dedicated != nullptr;
+    block.unused[0] = block.size;
+    if(isHostVisible(type)){
+      VK_CHECK_RESULT(dispatch.MapMemory(device, mem, 0, VK_WHOLE_SIZE, 0, (void**)&block.data));
+    }
+    if(block.dedicated){
+      TRACE("Memory arena: dedicated allocation of " << block.size << " bytes for memory type " << type);
+    }else{
+      TRACE("Memory arena: new block of " << (block.size >> 20) << " MiB for memory type " << type);
+    }
+    return &block;
+  }
+  void freeBlock(std::list<Block>::iterator it){
+    auto &dispatch = device_dispatch[GetKey(device)];
+    if(it->data != nullptr){
+      dispatch.UnmapMemory(device, it->mem);
+    }
+    dispatch.FreeMemory(device, it->mem, nullptr);
+    blocks.erase(it);
+  }
+public:
+  MemoryArena(const MemoryArena &) = delete;
+  MemoryArena(VkDevice device, VkPhysicalDevice physicalDevice): device(device){
+    auto &dispatch = instance_dispatch[GetKey(physicalDevice)];
+    dispatch.GetPhysicalDeviceMemoryProperties(physicalDevice, &mem_props);
+    VkPhysicalDeviceProperties props;
+    dispatch.GetPhysicalDeviceProperties(physicalDevice, &props);
+    granularity = std::max<VkDeviceSize>({props.limits.bufferImageGranularity, props.limits.nonCoherentAtomSize, 1});
+    // Host ranges are locked page by page, see prepareHostPages().
+    host_granularity = roundUp(sysconf(_SC_PAGESIZE), granularity);
+    const char *env = getenv("PRIMUS_VK_ARENA_BLOCK_MB");
+    if(env != nullptr){
+      block_size = VkDeviceSize(std::max(1, std::stoi(std::string{env}))) << 20;
+    }
+  }
+  ~MemoryArena(){
+    while(!blocks.empty()){
+      freeBlock(blocks.begin());
+    }
+  }
+
+  // `dedicated` names the image or buffer if it needs memory of its own.
+  Allocation allocate(const VkMemoryRequirements &requirements, uint32_t type, const VkMemoryDedicatedAllocateInfo *dedicated = nullptr){
+    const VkDeviceSize step = isHostVisible(type) ? host_granularity : granularity;
+    const VkDeviceSize alignment = roundUp(requirements.alignment, step);
+    const VkDeviceSize size = roundUp(requirements.size, step);
+    std::unique_lock<std::mutex> lock(mutex);
+    Allocation allocation;
+    if(dedicated != nullptr){
+      // Has to be exactly the size the driver asked for.
+      Block &block = *addBlock(type, requirements.size, dedicated);
+      block.unused.clear();
+      block.used = block.size;
+      return Allocation{&block, 0, block.size};
+    }
+    for(auto &block: blocks){
+      if(block.type == type && !block.dedicated && block.size - block.used >= size && carve(block, size, alignment, allocation)){
+	return allocation;
+      }
+    }
+    carve(*addBlock(type, roundUp(size, alignment)), size, alignment, allocation);
+    return allocation;
+  }
+  void invalidate(const Allocation &allocation){
+    VkMappedMemoryRange range {
+      .sType = VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE,
+      .pNext = VK_NULL_HANDLE,
+      .memory = allocation.block->mem,
+      .offset = allocation.offset,
+      .size = allocation.size
+    };
+    VK_CHECK_RESULT(device_dispatch[GetKey(device)].InvalidateMappedMemoryRanges(device, 1, &range));
+  }
+  void release(const Allocation &allocation){
+    if(allocation.block == nullptr){
+      return;
+    }
+    std::unique_lock<std::mutex> lock(mutex);
+    Block &block = *allocation.block;
+    auto range = block.unused.emplace(allocation.offset, allocation.size).first;
+    auto after = std::next(range);
+    if(after != block.unused.end() && range->first + range->second == after->first){
+      range->second += after->second;
+      block.unused.erase(after);
+    }
+    if(range != block.unused.begin()){
+      auto before = std::prev(range);
+      if(before->first + before->second == range->first){
+	before->second += range->second;
+	block.unused.erase(range);
+      }
+    }
+    block.used -= allocation.size;
+    if(block.used != 0){
+      return;
+    }
+    auto it = std::find_if(blocks.begin(), blocks.end(), [&block](const Block &b){ return &b == &block; });
+    if(block.dedicated){
+      freeBlock(it);
+      return;
+    }
+    // Keep one empty block per type for the next swapchain.
+    for(auto &other: blocks){
+      if(&other != &block && other.type == block.type && !other.dedicated && other.used == 0){
+	freeBlock(it);
+	return;
+      }
+    }
+  }
+};
+std::map<void *, std::unique_ptr<MemoryArena>> device_arenas;
+
+// Memory requirements of an image or buffer; `dedicated` is set if the
+// driver requires or prefers an allocation of its own for it.
+VkMemoryRequirements imageMemoryRequirements(VkDevice device, VkImage img, bool &dedicated){
+  auto &dispatch = device_dispatch[GetKey(device)];
+  if(dispatch.GetImageMemoryRequirements2 == nullptr){
+    VkMemoryRequirements memRequirements {};
+    dispatch.GetImageMemoryRequirements(device, img, &memRequirements);
+    return memRequirements;
+  }
+  VkImageMemoryRequirementsInfo2 info {.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_REQUIREMENTS_INFO_2};
+  info.image = img;
+  VkMemoryDedicatedRequirements dedicatedRequirements {.sType = VK_STRUCTURE_TYPE_MEMORY_DEDICATED_REQUIREMENTS};
+  VkMemoryRequirements2 memRequirements {.sType = VK_STRUCTURE_TYPE_MEMORY_REQUIREMENTS_2};
+  memRequirements.pNext = &dedicatedRequirements;
+  dispatch.GetImageMemoryRequirements2(device, &info, &memRequirements);
+  dedicated = dedicatedRequirements.requiresDedicatedAllocation || dedicatedRequirements.prefersDedicatedAllocation;
+  return memRequirements.memoryRequirements;
+}
+VkMemoryRequirements bufferMemoryRequirements(VkDevice device, VkBuffer buf, bool &dedicated){
+  auto &dispatch = device_dispatch[GetKey(device)];
+  if(dispatch.GetBufferMemoryRequirements2 == nullptr){
+    VkMemoryRequirements memRequirements {};
+    dispatch.GetBufferMemoryRequirements(device, buf, &memRequirements);
+    return memRequirements;
+  }
+  VkBufferMemoryRequirementsInfo2 info {.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_REQUIREMENTS_INFO_2};
+  info.buffer = buf;
+  VkMemoryDedicatedRequirements dedicatedRequirements {.sType = VK_STRUCTURE_TYPE_MEMORY_DEDICATED_REQUIREMENTS};
+  VkMemoryRequirements2 memRequirements {.sType = VK_STRUCTURE_TYPE_MEMORY_REQUIREMENTS_2};
+  memRequirements.pNext = &dedicatedRequirements;
+  dispatch.GetBufferMemoryRequirements2(device, &info, &memRequirements);
+  dedicated = dedicatedRequirements.requiresDedicatedAllocation || dedicatedRequirements.prefersDedicatedAllocation;
+  return memRequirements.memoryRequirements;
+}
+
 struct MappedMemory{
   VkDevice device;
-  VkDeviceMemory mem;
+  MemoryArena::Allocation memory;
   char* data;
-  MappedMemory(VkDevice device, FramebufferImage &img);
+  VkDeviceSize size;
+  MappedMemory(VkDevice device, const MemoryArena::Allocation &memory);
   ~MappedMemory();
 };
 struct FramebufferImage {
   VkImage img;
-  VkDeviceMemory mem;
+  MemoryArena::Allocation memory;
+  VkExtent2D extent;
+  VkFormat format;
 
   VkDevice device;
 
   std::shared_ptr<MappedMemory> mapped;
   FramebufferImage(FramebufferImage &) = delete;
-  FramebufferImage(VkDevice device, VkExtent2D size, VkImageTiling tiling, VkImageUsageFlags usage, VkFormat format, std::function<uint32_t(uint32_t memory_type_bits)> memoryTypeIndex): device(device){
+  FramebufferImage(VkDevice device, VkExtent2D size, VkImageTiling tiling, VkImageUsageFlags usage, VkFormat format, std::function<uint32_t(uint32_t memory_type_bits)> memoryTypeIndex): extent(size), format(format), device(device){
     TRACE("Creating image: " << size.width << "x" << size.height);
     VkImageCreateInfo imageCreateCI {};
     imageCreateCI.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
@@ -329,13 +606,13 @@ struct FramebufferImage {
     imageCreateCI.usage = usage;
     VK_CHECK_RESULT(device_dispatch[GetKey(device)].CreateImage(device, &imageCreateCI, nullptr, &img));
 
-    VkMemoryRequirements memRequirements {};
-    VkMemoryAllocateInfo memAllocInfo {.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO};
-    device_dispatch[GetKey(device)].GetImageMemoryRequirements(device, img, &memRequirements);
-    memAllocInfo.allocationSize = memRequirements.size;
-    memAllocInfo.memoryTypeIndex = memoryTypeIndex(memRequirements.memoryTypeBits);
-    VK_CHECK_RESULT(device_dispatch[GetKey(device)].AllocateMemory(device, &memAllocInfo, nullptr, &mem));
-    VK_CHECK_RESULT(device_dispatch[GetKey(device)].BindImageMemory(device, img, mem, 0));
+    VkMemoryDedicatedAllocateInfo dedicated {.sType = VK_STRUCTURE_TYPE_MEMORY_DEDICATED_ALLOCATE_INFO};
+    dedicated.image = img;
+    bool wantsDedicated = false;
+    VkMemoryRequirements memRequirements = imageMemoryRequirements(device, img, wantsDedicated);
+    memory = device_arenas[GetKey(device)]->allocate(memRequirements, memoryTypeIndex(memRequirements.memoryTypeBits),
+      wantsDedicated ? &dedicated : nullptr);
+    VK_CHECK_RESULT(device_dispatch[GetKey(device)].BindImageMemory(device, img, memory.block->mem, memory.offset));
   }
   std::shared_ptr<MappedMemory> getMapped(){
     if(!mapped){
@@ -344,7 +621,13 @@ struct FramebufferImage {
     return mapped;
   }
   void map(){
-    mapped = std::make_shared<MappedMemory>(device, *this);
+    mapped = std::make_shared<MappedMemory>(device, memory);
+  }
+  void invalidate(){
+    device_arenas[GetKey(device)]->invalidate(memory);
+  }
+  bool matches(VkExtent2D size, VkFormat format) const {
+    return extent.width == size.width && extent.height == size.height && this->format == format;
   }
   VkSubresourceLayout getLayout(){
     VkImageSubresource subResource { VK_IMAGE_ASPECT_COLOR_BIT, 0, 0 };
@@ -354,17 +637,168 @@ struct FramebufferImage {
   }
   ~FramebufferImage(){
     mapped.reset();
-    device_dispatch[GetKey(device)].FreeMemory(device, mem, nullptr);
     device_dispatch[GetKey(device)].DestroyImage(device, img, nullptr);
+    device_arenas[GetKey(device)]->release(memory);
+  }
+};
+struct FramebufferBuffer {
+  VkBuffer buf;
+  MemoryArena::Allocation memory;
+  VkDeviceSize size;
+
+  VkDevice device;
+
+  std::shared_ptr<MappedMemory> mapped;
+  FramebufferBuffer(FramebufferBuffer &) = delete;
+  FramebufferBuffer(VkDevice device, VkDeviceSize size, VkBufferUsageFlags usage, std::function<uint32_t(uint32_t memory_type_bits)> memoryTypeIndex): size(size), device(device){
+    VkBufferCreateInfo bufferCreateCI {.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO};
+    bufferCreateCI.size = size;
+    bufferCreateCI.usage = usage;
+    bufferCreateCI.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    VK_CHECK_RESULT(device_dispatch[GetKey(device)].CreateBuffer(device, &bufferCreateCI, nullptr, &buf));
+
+    VkMemoryDedicatedAllocateInfo dedicated {.sType = VK_STRUCTURE_TYPE_MEMORY_DEDICATED_ALLOCATE_INFO};
+    dedicated.buffer = buf;
+    bool wantsDedicated = false;
+    VkMemoryRequirements memRequirements = bufferMemoryRequirements(device, buf, wantsDedicated);
+    memory = device_arenas[GetKey(device)]->allocate(memRequirements, memoryTypeIndex(memRequirements.memoryTypeBits),
+      wantsDedicated ? &dedicated : nullptr);
+    VK_CHECK_RESULT(device_dispatch[GetKey(device)].BindBufferMemory(device, buf, memory.block->mem, memory.offset));
+  }
+  std::shared_ptr<MappedMemory> getMapped(){
+    if(!mapped){
+      throw std::runtime_error("not mapped");
+    }
+    return mapped;
+  }
+  void map(){
+    mapped = std::make_shared<MappedMemory>(device, memory);
+  }
+  void invalidate(){
+    device_arenas[GetKey(device)]->invalidate(memory);
+  }
+  ~FramebufferBuffer(){
+    mapped.reset();
+    device_dispatch[GetKey(device)].DestroyBuffer(device, buf, nullptr);
+    device_arenas[GetKey(device)]->release(memory);
+  }
+};
+
+// Host memory frames pass through is faulted in and locked when it is set
+// up, see prepareHostPages().
+void prepareFramePages(void *data, VkDeviceSize size, int node = -1){
+  static std::atomic<bool> warned{false};
+  if(!prepareHostPages(data, size, node) && !warned.exchange(true)){
+    TRACE("Could not lock frame memory: " << strerror(errno) << ", raise RLIMIT_MEMLOCK to keep it resident.");
+  }
+}
+
+// One page-aligned host allocation imported into both GPUs with
+// VK_EXT_external_memory_host. The render GPU writes the frame into it and
+// the display GPU reads it from there, the CPU does not copy anything.
+struct SharedHostBuffer {
+  VkDeviceSize size;
+  void *data = nullptr;
+
+  VkDevice render_device;
+  VkBuffer render_buf = VK_NULL_HANDLE;
+  VkDeviceMemory render_mem = VK_NULL_HANDLE;
+  VkDevice display_device;
+  VkBuffer display_buf = VK_NULL_HANDLE;
+  VkDeviceMemory display_mem = VK_NULL_HANDLE;
+
+  SharedHostBuffer(SharedHostBuffer &) = delete;
+  SharedHostBuffer(VkDevice render_device, VkDevice display_device, VkDeviceSize frameSize, VkDeviceSize alignment,
+		   std::function<uint32_t(uint32_t memory_type_bits)> renderMemoryTypeIndex,
+		   std::function<uint32_t(uint32_t memory_type_bits)> displayMemoryTypeIndex):
+    render_device(render_device), display_device(display_device){
+    size = (frameSize + alignment - 1) / alignment * alignment;
+    data = aligned_alloc(alignment, size);
+    if(data == nullptr){
+      throw std::runtime_error("Host allocation failed");
+    }
+    // Before the GPUs import it, so the pages are already placed.
+    prepareFramePages(data, size, ThreadPlacement::shared().preferredNode());
+    try{
+      import(render_device, VK_BUFFER_USAGE_TRANSFER_DST_BIT, renderMemoryTypeIndex, render_buf, render_mem);
+      import(display_device, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, displayMemoryTypeIndex, display_buf, display_mem);
+    }catch(...){
+      release();
+      throw;
+    }
+  }
+  ~SharedHostBuffer(){
+    release();
+  }
+private:
+  void import(VkDevice device, VkBufferUsageFlags usage, std::function<uint32_t(uint32_t memory_type_bits)> &memoryTypeIndex, VkBuffer &buf, VkDeviceMemory &mem){
+    auto &dispatch = device_dispatch[GetKey(device)];
+    VkExternalMemoryBufferCreateInfo externalCI {.sType = VK_STRUCTURE_TYPE_EXTERNAL_MEMORY_BUFFER_CREATE_INFO};
+    externalCI.handleTypes = VK_EXTERNAL_MEMORY_HANDLE_TYPE_HOST_ALLOCATION_BIT_EXT;
+    VkBufferCreateInfo bufferCreateCI {.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO};
+    bufferCreateCI.pNext = &externalCI;
+    bufferCreateCI.size = size;
+    bufferCreateCI.usage = usage;
+    bufferCreateCI.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    if(dispatch.CreateBuffer(device, &bufferCreateCI, nullptr, &buf) != VK_SUCCESS){
+      throw std::runtime_error("Creating an external buffer failed");
+    }
+
+    VkMemoryRequirements memRequirements {};
+    dispatch.GetBufferMemoryRequirements(device, buf, &memRequirements);
+    VkMemoryHostPointerPropertiesEXT hostProps {.sType = VK_STRUCTURE_TYPE_MEMORY_HOST_POINTER_PROPERTIES_EXT};
+    if(dispatch.GetMemoryHostPointerPropertiesEXT(device, VK_EXTERNAL_MEMORY_HANDLE_TYPE_HOST_ALLOCATION_BIT_EXT, data, &hostProps) != VK_SUCCESS
+       || (memRequirements.memoryTypeBits & hostProps.memoryTypeBits) == 0 || memRequirements.size > size){
+      throw std::runtime_error("Host pointer not importable");
+    }
+
+    VkImportMemoryHostPointerInfoEXT importInfo {.sType = VK_STRUCTURE_TYPE_IMPORT_MEMORY_HOST_POINTER_INFO_EXT};
+    importInfo.handleType = VK_EXTERNAL_MEMORY_HANDLE_TYPE_HOST_ALLOCATION_BIT_EXT;
+    importInfo.pHostPointer = data;
+    VkMemoryAllocateInfo memAllocInfo {.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO};
+    memAllocInfo.pNext = &importInfo;
+    memAllocInfo.allocationSize = size;
+    memAllocInfo.memoryTypeIndex = memoryTypeIndex(memRequirements.memoryTypeBits & hostProps.memoryTypeBits);
+    if(dispatch.AllocateMemory(device, &memAllocInfo, nullptr, &mem) != VK_SUCCESS){
+      throw std::runtime_error("Importing host memory failed");
+    }
+    VK_CHECK_RESULT(dispatch.BindBufferMemory(device, buf, mem, 0));
+  }
+  static void destroy(VkDevice device, VkBuffer buf, VkDeviceMemory mem){
+    if(buf != VK_NULL_HANDLE){
+      device_dispatch[GetKey(device)].DestroyBuffer(device, buf, nullptr);
+    }
+    if(mem != VK_NULL_HANDLE){
+      device_dispatch[GetKey(device)].FreeMemory(device, mem, nullptr);
+    }
+  }
+  void release(){
+    destroy(render_device, render_buf, render_mem);
+    destroy(display_device, display_buf, display_mem);
+    releaseHostPages(data, size);
+    free(data);
   }
 };
-MappedMemory::MappedMemory(VkDevice device, FramebufferImage &img): device(device), mem(img.mem){
-  device_dispatch[GetKey(device)].MapMemory(device, img.mem, 0, VK_WHOLE_SIZE, 0, (void**)&data);
+// The arena keeps the block mapped, this is only a view of one range.
+MappedMemory::MappedMemory(VkDevice device, const MemoryArena::Allocation &memory): device(device), memory(memory), size(memory.size){
+  if(memory.block->data == nullptr){
+    throw std::runtime_error("Memory is not host visible");
+  }
+  data = memory.block->data + memory.offset;
+  prepareFramePages(data, size);
 }
 MappedMemory::~MappedMemory(){
-  device_dispatch[GetKey(device)].UnmapMemory(device, mem);
+  releaseHostPages(data, size);
 }
 class CommandBuffer;
+class GpuTimer;
+// Timestamp properties of the queue a device's copies run on; valid_bits
+// is 0 if it cannot write timestamps or PRIMUS_VK_GPU_TIMESTAMPS is off.
+struct TimestampInfo {
+  double period = 0;
+  uint32_t valid_bits = 0;
+};
+
 class Fence{
   VkDevice device;
 public:
@@ -410,10 +844,119 @@ public:
     }
   }
 };
+// A VK_KHR_timeline_semaphore; the host can wait for it to reach a value.
+// Each swapchain has one per device and every submit signals the next value,
+// so waiting for a value waits for that submit and everything before it.
+//
+// Devices without timeline semaphores get one fence per submit instead. A
+// fence signals once its submit and everything submitted before it on the
+// queue finished, so waiting for a value waits for the fence of the first
+// submit at or after it.
+class TimelineSemaphore{
+  VkDevice device;
+  // Fence fallback: fences of submits not known to be done yet, in value
+  // order, and done ones to reuse once no waiter holds them anymore.
+  std::mutex mutex;
+  std::deque<std::pair<uint64_t, std::shared_ptr<Fence>>> pending;
+  std::vector<std::shared_ptr<Fence>> spare;
+  uint64_t completed = 0;
+public:
+  VkSemaphore sem = VK_NULL_HANDLE;
+  TimelineSemaphore(VkDevice dev, bool native): device(dev){
+    if(!native){
+      return;
+    }
+    VkSemaphoreTypeCreateInfoKHR typeInfo = {.sType=VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO_KHR};
+    typeInfo.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE_KHR;
+    typeInfo.initialValue = 0;
+    VkSemaphoreCreateInfo semInfo = {.sType=VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO};
+    semInfo.pNext = &typeInfo;
+    VK_CHECK_RESULT(device_dispatch[GetKey(device)].CreateSemaphore(device, &semInfo, nullptr, &sem));
+  }
+  TimelineSemaphore(const TimelineSemaphore &) = delete;
+  // Submits `submitInfo`, which must not signal anything yet, so that it
+  // signals `value` and `signal` unless that is VK_NULL_HANDLE.
+  VkResult submit(VkQueue queue, VkSubmitInfo submitInfo, VkSemaphore signal, uint64_t value){
+    if(sem != VK_NULL_HANDLE){
+      const VkSemaphore signals[] = {sem, signal};
+      // The value of the binary semaphore is ignored.
+      const uint64_t signalValues[] = {value, 0};
+      const uint32_t signalCount = signal == VK_NULL_HANDLE ? 1 : 2;
+      VkTimelineSemaphoreSubmitInfoKHR timelineInfo = {.sType=VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO_KHR};
+      timelineInfo.pNext = submitInfo.pNext;
+      timelineInfo.signalSemaphoreValueCount = signalCount;
+      timelineInfo.pSignalSemaphoreValues = signalValues;
+      submitInfo.pNext = &timelineInfo;
+      submitInfo.signalSemaphoreCount = signalCount;
+      submitInfo.pSignalSemaphores = signals;
+      return device_dispatch[GetKey(device)].QueueSubmit(queue, 1, &submitInfo, VK_NULL_HANDLE);
+    }
+    std::unique_lock<std::mutex> lock(mutex);
+    std::shared_ptr<Fence> fence;
+    for(auto it = spare.begin(); it != spare.end(); ++it){
+      if(it->use_count() == 1){
+	fence = std::move(*it);
+	spare.erase(it);
+	fence->reset();
+	break;
+      }
+    }
+    if(!fence){
+      fence = std::make_shared<Fence>(device);
+    }
+    submitInfo.signalSemaphoreCount = signal == VK_NULL_HANDLE ? 0 : 1;
+    submitInfo.pSignalSemaphores = &signal;
+    const VkResult res = device_dispatch[GetKey(device)].QueueSubmit(queue, 1, &submitInfo, fence->fence);
+    if(res == VK_SUCCESS){
+      pending.emplace_back(value, std::move(fence));
+    }
+    return res;
+  }
+  // Values that were never submitted count as reached.
+  void await(uint64_t value){
+    if(sem != VK_NULL_HANDLE){
+      VkSemaphoreWaitInfoKHR waitInfo = {.sType=VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO_KHR};
+      waitInfo.semaphoreCount = 1;
+      waitInfo.pSemaphores = &sem;
+      waitInfo.pValues = &value;
+      VK_CHECK_RESULT(device_dispatch[GetKey(device)].WaitSemaphoresKHR(device, &waitInfo, 10000000000L));
+      return;
+    }
+    std::shared_ptr<Fence> fence;
+    uint64_t reached = 0;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      if(value <= completed){
+	return;
+      }
+      auto it = std::find_if(pending.begin(), pending.end(), [value](const std::pair<uint64_t, std::shared_ptr<Fence>> &entry){ return entry.first >= value; });
+      if(it == pending.end()){
+	return;
+      }
+      reached = it->first;
+      fence = it->second;
+    }
+    fence->await();
+    std::unique_lock<std::mutex> lock(mutex);
+    completed = std::max(completed, reached);
+    while(!pending.empty() && pending.front().first <= completed){
+      spare.push_back(std::move(pending.front().second));
+      pending.pop_front();
+    }
+  }
+  ~TimelineSemaphore(){
+    if(sem != VK_NULL_HANDLE){
+      device_dispatch[GetKey(device)].DestroySemaphore(device, sem, nullptr);
+    }
+  }
+};
 enum class ImageType : int{
   RENDER_TARGET_IMAGE,
   RENDER_COPY_IMAGE,
   DISPLAY_IMAGE,
+  RENDER_HOST_IMPORT,
+  DISPLAY_HOST_IMPORT,
+  DISPLAY_SCRATCH,
   IMAGE_TYPE_COUNT
 };
 std::ostream &operator<<( std::ostream &output, const ImageType &type ) {
@@ -427,33 +970,367 @@ std::ostream &operator<<( std::ostream &output, const ImageType &type ) {
   case ImageType::DISPLAY_IMAGE:
     output << "Display Image";
     break;
+  case ImageType::RENDER_HOST_IMPORT:
+    output << "Render Host Import";
+    break;
+  case ImageType::DISPLAY_HOST_IMPORT:
+    output << "Display Host Import";
+    break;
+  case ImageType::DISPLAY_SCRATCH:
+    output << "Display Scratch";
+    break;
   }
   return output;
 }
+// Size of one texel for the swapchain formats the buffer based paths
+// support, 0 for all others.
+size_t formatBytesPerPixel(VkFormat format){
+  switch(format){
+  case VK_FORMAT_B8G8R8A8_UNORM:
+  case VK_FORMAT_B8G8R8A8_SRGB:
+  case VK_FORMAT_R8G8B8A8_UNORM:
+  case VK_FORMAT_R8G8B8A8_SRGB:
+  case VK_FORMAT_A2R10G10B10_UNORM_PACK32:
+  case VK_FORMAT_A2B10G10R10_UNORM_PACK32:
+    return 4;
+  case VK_FORMAT_R16G16B16A16_SFLOAT:
+    return 8;
+  default:
+    return 0;
+  }
+}
+// A compute shader reading and writing storage buffers only, with one
+// descriptor set per ImageWorker.
+class ComputePipeline {
+  VkDevice device;
+  uint32_t bindingCount;
+public:
+  VkDescriptorSetLayout setLayout;
+  VkPipelineLayout layout;
+  VkPipeline pipeline;
+  VkDescriptorPool pool;
+
+  ComputePipeline(ComputePipeline &) = delete;
+  ComputePipeline(VkDevice device, const uint32_t *code, size_t codeSize, uint32_t bindingCount, uint32_t pushConstantsSize, uint32_t maxSets):
+    device(device), bindingCount(bindingCount){
+    auto &dispatch = device_dispatch[GetKey(device)];
+    std::vector<VkDescriptorSetLayoutBinding> bindings(bindingCount);
+    for(uint32_t i = 0; i < bindingCount; i++){
+      bindings[i] = VkDescriptorSetLayoutBinding{i, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_COMPUTE_BIT, nullptr};
+    }
+    VkDescriptorSetLayoutCreateInfo setLayoutInfo{.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO};
+    setLayoutInfo.bindingCount = bindingCount;
+    setLayoutInfo.pBindings = bindings.data();
+    VK_CHECK_RESULT(dispatch.CreateDescriptorSetLayout(device, &setLayoutInfo, nullptr, &setLayout));
+
+    VkPushConstantRange pushRange{VK_SHADER_STAGE_COMPUTE_BIT, 0, pushConstantsSize};
+    VkPipelineLayoutCreateInfo layoutInfo{.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO};
+    layoutInfo.setLayoutCount = 1;
+    layoutInfo.pSetLayouts = &setLayout;
+    layoutInfo.pushConstantRangeCount = 1;
+    layoutInfo.pPushConstantRanges = &pushRange;
+    VK_CHECK_RESULT(dispatch.CreatePipelineLayout(device, &layoutInfo, nullptr, &layout));
+
+    VkShaderModuleCreateInfo moduleInfo{.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO};
+    moduleInfo.codeSize = codeSize;
+    moduleInfo.pCode = code;
+    VkShaderModule module;
+    VK_CHECK_RESULT(dispatch.CreateShaderModule(device, &moduleInfo, nullptr, &module));
+
+    VkComputePipelineCreateInfo pipelineInfo{.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO};
+    pipelineInfo.stage.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+    pipelineInfo.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+    pipelineInfo.stage.module = module;
+    pipelineInfo.stage.pName = "main";
+    pipelineInfo.layout = layout;
+    VK_CHECK_RESULT(dispatch.CreateComputePipelines(device, VK_NULL_HANDLE, 1, &pipelineInfo, nullptr, &pipeline));
+    dispatch.DestroyShaderModule(device, module, nullptr);
+
+    VkDescriptorPoolSize poolSize{VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, bindingCount * maxSets};
+    VkDescriptorPoolCreateInfo poolInfo{.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO};
+    poolInfo.maxSets = maxSets;
+    poolInfo.poolSizeCount = 1;
+    poolInfo.pPoolSizes = &poolSize;
+    VK_CHECK_RESULT(dispatch.CreateDescriptorPool(device, &poolInfo, nullptr, &pool));
+  }
+  ~ComputePipeline(){
+    auto &dispatch = device_dispatch[GetKey(device)];
+    dispatch.DestroyDescriptorPool(device, pool, nullptr);
+    dispatch.DestroyPipeline(device, pipeline, nullptr);
+    dispatch.DestroyPipelineLayout(device, layout, nullptr);
+    dispatch.DestroyDescriptorSetLayout(device, setLayout, nullptr);
+  }
+  // Binds `buffers` in order to the bindings 0..n-1. The set lives as long
+  // as the pipeline.
+  VkDescriptorSet allocateSet(std::vector<VkBuffer> buffers){
+    auto &dispatch = device_dispatch[GetKey(device)];
+    VkDescriptorSet set;
+    VkDescriptorSetAllocateInfo allocInfo{.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO};
+    allocInfo.descriptorPool = pool;
+    allocInfo.descriptorSetCount = 1;
+    allocInfo.pSetLayouts = &setLayout;
+    VK_CHECK_RESULT(dispatch.AllocateDescriptorSets(device, &allocInfo, &set));
+    std::vector<VkDescriptorBufferInfo> bufferInfos(bindingCount);
+    std::vector<VkWriteDescriptorSet> writes(bindingCount);
+    for(uint32_t i = 0; i < bindingCount; i++){
+      bufferInfos[i] = VkDescriptorBufferInfo{buffers[i], 0, VK_WHOLE_SIZE};
+      writes[i] = VkWriteDescriptorSet{.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET};
+      writes[i].dstSet = set;
+      writes[i].dstBinding = i;
+      writes[i].descriptorCount = 1;
+      writes[i].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+      writes[i].pBufferInfo = &bufferInfos[i];
+    }
+    dispatch.UpdateDescriptorSets(device, bindingCount, writes.data(), 0, nullptr);
+    return set;
+  }
+};
+
 struct PrimusSwapchain;
+struct DirtyTiles;
+struct YuvTransfer;
 struct ImageWorker {
   PrimusSwapchain &swapchain;
 
   std::shared_ptr<FramebufferImage> render_image;
+  // With a transfer scale below 1 the frame is scaled down into
+  // render_scaled_image before and up from display_scaled_image after the
+  // transfer.
+  std::shared_ptr<FramebufferImage> render_scaled_image;
+  std::shared_ptr<FramebufferImage> display_scaled_image;
   std::shared_ptr<FramebufferImage> render_copy_image;
   std::shared_ptr<FramebufferImage> display_src_image;
-  Fence render_copy_fence;
+  // Replace render_copy_image and display_src_image with buffer staging.
+  std::shared_ptr<FramebufferBuffer> render_copy_buffer;
+  std::shared_ptr<FramebufferBuffer> display_src_buffer;
+  // Replaces render_copy_image and display_src_image in zero-copy mode.
+  std::shared_ptr<SharedHostBuffer> shared_buffer;
+  // Timeline values signalled once this image's latest render copy and
+  // display upload are done.
+  uint64_t render_done = 0;
+  uint64_t display_done = 0;
+  // Counts the changes of the frame the display source holds. With dirty
+  // tiles, `unchanged` is set when the latest frame equals the previous
+  // one of this image, so neither the host copy nor, if the display image
+  // still holds it, the upload are needed.
+  uint64_t content_version = 0;
+  bool unchanged = false;
   Semaphore display_semaphore;
-  VkImage display_image = VK_NULL_HANDLE;
+  // Signalled when the display image this image's frame goes to is
+  // acquired, waited for by the upload.
+  Semaphore acquire_semaphore;
 
   std::shared_ptr<CommandBuffer> render_copy_command;
-  std::shared_ptr<CommandBuffer> display_command;
-  std::unique_ptr<Fence> display_command_fence;
-
-  ImageWorker(PrimusSwapchain &swapchain, VkImage display_image, const VkSwapchainCreateInfoKHR &createInfo);
+  // GPU time of the readback and of the upload, with
+  // PRIMUS_VK_GPU_TIMESTAMPS.
+  std::shared_ptr<GpuTimer> render_timer;
+  std::shared_ptr<GpuTimer> display_timer;
+  // Upload into each of the swapchain's display images, recorded the first
+  // time a frame of this image goes there.
+  std::vector<std::shared_ptr<CommandBuffer>> display_commands;
+
+  // Banded readback: band k of a frame is copied by render_band_commands[k],
+  // which signals render_done - band_count + k + 1, and is uploaded by
+  // display_band_commands[target][k] as soon as the host copied it.
+  std::vector<std::shared_ptr<CommandBuffer>> render_band_commands;
+  std::vector<std::vector<std::shared_ptr<CommandBuffer>>> display_band_commands;
+
+  std::unique_ptr<DirtyTiles> dirty;
+  std::unique_ptr<YuvTransfer> yuv;
+
+  // Taken over from the same image of the old swapchain, initImages() uses
+  // the ones that still fit and drops the rest.
+  struct Spares {
+    std::shared_ptr<FramebufferImage> render_scaled_image;
+    std::shared_ptr<FramebufferImage> display_scaled_image;
+    std::shared_ptr<FramebufferImage> render_copy_image;
+    std::shared_ptr<FramebufferImage> display_src_image;
+    std::shared_ptr<FramebufferBuffer> render_copy_buffer;
+    std::shared_ptr<FramebufferBuffer> display_src_buffer;
+    std::shared_ptr<SharedHostBuffer> shared_buffer;
+  } spares;
+
+  // Only creates the image the application renders to, the rest follows
+  // in PrimusSwapchain::prepareImages().
+  ImageWorker(PrimusSwapchain &swapchain, ImageWorker *donor = nullptr);
   ImageWorker(ImageWorker &&other) = default;
   ~ImageWorker();
-  void initImages( const VkSwapchainCreateInfoKHR &createInfo);
+  void takeOver(ImageWorker &donor);
+  void initRenderImage();
+  void initImages(CommandBuffer &setup);
   void createCommandBuffers();
-  void copyImageData(uint32_t idx, std::vector<VkSemaphore> sems);
+  void createZeroCopyCommandBuffers();
+  void createYuvCommandBuffers();
+  void createBandedCommandBuffers();
+  void recordDisplayCommand(CommandBuffer &cmd, VkImage display_image);
+  void recordDisplayBandCommands(uint32_t target);
+  CommandBuffer &displayCommand(uint32_t target);
+  VkImage beginRenderSource(CommandBuffer &cmd);
+  void endRenderSource(CommandBuffer &cmd);
+  VkImage beginDisplayTarget(CommandBuffer &cmd, VkImage display_image);
+  void endDisplayTarget(CommandBuffer &cmd, VkImage display_image);
+  void hostCopy(char *dst, size_t dstPitch, const char *src, size_t srcPitch, size_t srcSize);
+  void copyImageData(uint32_t idx);
+  void upload(uint32_t target);
+  void copyBands(uint32_t idx, uint32_t target);
+  void readRenderTimer();
+  void readDisplayTimer();
+};
+// Stands in for the display swapchain with PRIMUS_VK_VIRTUAL_DISPLAY, so the
+// whole pipeline runs without a window or a second GPU. Frames are uploaded
+// into host-visible linear images of the display device, and a scanout
+// thread puts them on screen at the simulated refresh rate: like FIFO
+// presentation every frame is shown for at least one refresh cycle, and an
+// image is free again once the next frame replaced it. With a refresh rate
+// of 0 frames are shown as soon as their upload finished.
+class VirtualDisplay {
+  VkQueue queue;
+  std::mutex &queue_mutex;
+  uint64_t period;
+  // Signalled by the empty submit behind each present once its upload is
+  // done; timeline_value is guarded by queue_mutex.
+  TimelineSemaphore timeline;
+  uint64_t timeline_value = 0;
+  std::vector<std::unique_ptr<FramebufferImage>> images;
+
+  struct Pending {
+    uint32_t index;
+    uint64_t done;
+    // When the application presented the frame, FramePacer::now() time.
+    uint64_t queued_at;
+  };
+  std::mutex mutex;
+  std::condition_variable changed;
+  std::deque<uint32_t> free;
+  std::deque<Pending> pending;
+  int64_t shown = -1;
+  bool stopping = false;
+  std::thread scanout;
+
+  void run(){
+    pthread_setname_np(pthread_self(), "virtual-display");
+    const uint64_t phase = FramePacer::now();
+    std::unique_lock<std::mutex> lock(mutex);
+    while(true){
+      changed.wait(lock, [this](){ return stopping || !pending.empty(); });
+      if(stopping){
+	return;
+      }
+      const Pending next = pending.front();
+      lock.unlock();
+      timeline.await(next.done);
+      uint64_t vblank = FramePacer::now();
+      if(period != 0){
+	vblank = phase + ((vblank - phase) / period + 1) * period;
+	const timespec ts = {time_t(vblank / 1000000000), long(vblank % 1000000000)};
+	while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr) == EINTR){
+	}
+      }
+      TRACE_INSTANT("scanout", next.index);
+      lock.lock();
+      pending.pop_front();
+      if(shown >= 0){
+	free.push_back(shown);
+      }
+      shown = next.index;
+      if(shown_frames.fetch_add(1, std::memory_order_relaxed) == 0){
+	first_shown_at.store(vblank, std::memory_order_relaxed);
+      }
+      last_shown_at.store(vblank, std::memory_order_relaxed);
+      latency_total_ns.fetch_add(vblank - next.queued_at, std::memory_order_relaxed);
+      latency_max_ns.store(std::max(latency_max_ns.load(std::memory_order_relaxed), vblank - next.queued_at), std::memory_order_relaxed);
+      changed.notify_all();
+    }
+  }
+
+public:
+  // Frames on screen, and the time from the application's present to the
+  // vblank that showed them.
+  std::atomic<uint64_t> shown_frames{0};
+  std::atomic<uint64_t> latency_total_ns{0};
+  std::atomic<uint64_t> latency_max_ns{0};
+  std::atomic<uint64_t> first_shown_at{0};
+  std::atomic<uint64_t> last_shown_at{0};
+
+  VirtualDisplay(const VirtualDisplay &) = delete;
+  VirtualDisplay(VkDevice device, bool timeline_semaphores, VkQueue queue, std::mutex &queue_mutex, double refresh, const VkSwapchainCreateInfoKHR *pCreateInfo,
+		 std::function<uint32_t(uint32_t memory_type_bits)> memoryTypeIndex):
+    queue(queue), queue_mutex(queue_mutex), period(refresh > 0 ? uint64_t(1e9 / refresh) : 0), timeline(device, timeline_semaphores){
+    for(uint32_t i = 0; i < pCreateInfo->minImageCount; i++){
+      images.emplace_back(new FramebufferImage(device, pCreateInfo->imageExtent, VK_IMAGE_TILING_LINEAR,
+	VK_IMAGE_USAGE_TRANSFER_DST_BIT, pCreateInfo->imageFormat, memoryTypeIndex));
+      free.push_back(i);
+    }
+    scanout = std::thread(&VirtualDisplay::run, this);
+  }
+  ~VirtualDisplay(){
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    changed.notify_all();
+    scanout.join();
+    std::unique_lock<std::mutex> lock(queue_mutex);
+    timeline.await(timeline_value);
+  }
+
+  std::vector<VkImage> handles() const {
+    std::vector<VkImage> result;
+    for(auto &image: images){
+      result.push_back(image->img);
+    }
+    return result;
+  }
+  // Refresh cycle in nanoseconds, 0 without refresh limit.
+  uint64_t refreshCycle() const {
+    return period;
+  }
+
+  // Waits for a free image and signals `signal` for it, like
+  // vkAcquireNextImageKHR without timeout.
+  VkResult acquire(VkSemaphore signal, uint32_t &index){
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      changed.wait(lock, [this](){ return !free.empty(); });
+      index = free.front();
+      free.pop_front();
+    }
+    VkSubmitInfo submitInfo = {.sType=VK_STRUCTURE_TYPE_SUBMIT_INFO};
+    submitInfo.signalSemaphoreCount = 1;
+    submitInfo.pSignalSemaphores = &signal;
+    std::unique_lock<std::mutex> lock(queue_mutex);
+    return device_dispatch[GetKey(queue)].QueueSubmit(queue, 1, &submitInfo, VK_NULL_HANDLE);
+  }
+  // Queues image `index` for scanout once `wait` is signalled, like
+  // vkQueuePresentKHR. The caller holds the queue mutex.
+  VkResult present(VkSemaphore wait, uint32_t index, uint64_t queued_at){
+    const uint64_t value = ++timeline_value;
+    const VkPipelineStageFlags waitStage = VK_PIPELINE_STAGE_ALL_COMMANDS_BIT;
+    VkSubmitInfo submitInfo = {.sType=VK_STRUCTURE_TYPE_SUBMIT_INFO};
+    submitInfo.waitSemaphoreCount = 1;
+    submitInfo.pWaitSemaphores = &wait;
+    submitInfo.pWaitDstStageMask = &waitStage;
+    const VkResult res = timeline.submit(queue, submitInfo, VK_NULL_HANDLE, value);
+    if(res != VK_SUCCESS){
+      return res;
+    }
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      pending.push_back(Pending{index, value, queued_at});
+    }
+    changed.notify_all();
+    return VK_SUCCESS;
+  }
 };
-struct PrimusSwapchain{
-  int max_fps = 0;
+
+struct PrimusSwapchain: PresentSource{
+  // PRIMUS_VK_MAX_FPS, may be fractional.
+  FramePacer pacer{[](){
+    const char *env = getenv("PRIMUS_VK_MAX_FPS");
+    return env != nullptr ? std::stod(std::string{env}) : 0.0;
+  }()};
+  // Deadlines follow the display's refresh cycle, see present().
+  bool pace_to_refresh = false;
   InstanceInfo &myInstance;
   std::chrono::steady_clock::time_point lastPresent = std::chrono::steady_clock::now();
   VkDevice device;
@@ -462,20 +1339,94 @@ struct PrimusSwapchain{
   std::mutex displayQueueMutex;
   VkQueue display_queue;
   VkSwapchainKHR backend;
+  // Replaces backend with PRIMUS_VK_VIRTUAL_DISPLAY. Destroyed after the
+  // images, whose uploads go to it.
+  std::unique_ptr<VirtualDisplay> virtual_display;
+  TimelineSemaphore render_timeline;
+  TimelineSemaphore display_timeline;
+  // Last values handed out on the timelines. render_value is only touched
+  // while presenting, display_value is guarded by displayQueueMutex.
+  uint64_t render_value = 0;
+  uint64_t display_value = 0;
+  std::vector<VkImage> display_images;
+  // The image and content_version each display image was last uploaded
+  // from, guarded by displayQueueMutex.
+  std::vector<std::pair<uint32_t, uint64_t>> display_contents;
+  // Images the application may acquire: all that are not on their way to
+  // the display.
+  std::mutex free_mutex;
+  std::condition_variable free_changed;
+  std::deque<uint32_t> free_images;
+  // The present threads acquire display images in frame order, at most
+  // max_acquired at a time, see acquireDisplayImage().
+  FutexWord acquire_turn;
+  uint32_t max_acquired = 1;
+  // First error or VK_SUBOPTIMAL_KHR the display swapchain returned, handed
+  // to the application by its next acquire or present.
+  std::atomic<VkResult> display_status{VK_SUCCESS};
+  // Time the application spent in vkAcquireNextImage2KHR, pacing excluded.
+  uint64_t acquire_count = 0;
+  uint64_t acquire_total_ns = 0;
+  uint64_t acquire_max_ns = 0;
+  std::unique_ptr<ComputePipeline> dirty_pipeline;
+  std::unique_ptr<ComputePipeline> yuv_encode_pipeline;
+  std::unique_ptr<ComputePipeline> yuv_decode_pipeline;
   std::vector<ImageWorker> images;
+  // Staging images, buffers and command buffers are only created by the
+  // first acquire, see prepareImages().
+  std::once_flag images_prepared;
   VkExtent2D imgSize;
+  VkFormat format;
+  // Size of the frame on its way between the GPUs, smaller than imgSize
+  // with PRIMUS_VK_TRANSFER_SCALE.
+  VkExtent2D transferSize;
+  VkFilter render_scale_filter = VK_FILTER_LINEAR;
+  VkFilter display_scale_filter = VK_FILTER_LINEAR;
 
   VkSurfaceCapabilitiesKHR surfaceCapabilities = { };
 
-  std::vector<std::unique_ptr<std::thread>> threads;
-
   std::shared_ptr<CreateOtherDevice> cod;
 
   bool suppress_suboptimal = false;
+  // Frames go through host memory imported into both GPUs instead of
+  // being copied by the CPU.
+  bool zero_copy = false;
+  // The import canUseZeroCopy() tried out, it goes to the first image
+  // without a spare that fits.
+  std::shared_ptr<SharedHostBuffer> zero_copy_probe;
+  // Stage frames in tightly packed buffers instead of linear images.
+  bool buffer_staging = false;
+  size_t bytes_per_pixel = 0;
+  // Number of row bands the host copy is pipelined in, 1 copies whole frames.
+  uint32_t band_count = 1;
+  uint32_t band_rows = 0;
+
+  // Set once a newer swapchain took over the images.
+  bool retired = false;
+  // Skip frames the display side falls behind on, see present().
+  bool drop_frames = false;
+  std::atomic<uint64_t> presented_frames{0};
+  std::atomic<uint64_t> dropped_frames{0};
+  // Bytes the dirty tiles saved the host copy, and frames presented again
+  // without an upload.
+  std::atomic<uint64_t> skipped_bytes{0};
+  std::atomic<uint64_t> reused_frames{0};
+  // Slot in the telemetry segment, nullptr without PRIMUS_VK_TELEMETRY.
+  telemetry::SwapchainStats *stats = nullptr;
+  TimestampInfo render_timestamps;
+  TimestampInfo display_timestamps;
+  // GPU time of readbacks and uploads, see GpuTimer.
+  std::atomic<uint64_t> gpu_readback_count{0};
+  std::atomic<uint64_t> gpu_readback_ns{0};
+  std::atomic<uint64_t> gpu_upload_count{0};
+  std::atomic<uint64_t> gpu_upload_ns{0};
+  // Hardware counters of the host copies, see PerfCounters.
+  PerfTotals perf_totals{};
 
   PrimusSwapchain(PrimusSwapchain &) = delete;
-  PrimusSwapchain(InstanceInfo &myInstance, VkDevice device, VkDevice display_device, VkSwapchainKHR backend, const VkSwapchainCreateInfoKHR *pCreateInfo, std::shared_ptr<CreateOtherDevice> &cod):
-    myInstance(myInstance), device(device), display_device(display_device), backend(backend), cod(cod){
+  PrimusSwapchain(InstanceInfo &myInstance, VkDevice device, VkDevice display_device, VkSwapchainKHR backend, const VkSwapchainCreateInfoKHR *pCreateInfo, uint32_t app_images, std::shared_ptr<CreateOtherDevice> &cod, PrimusSwapchain *old):
+    myInstance(myInstance), device(device), display_device(display_device), backend(backend),
+    render_timeline(device, hasTimelineSemaphores(*cod, device)), display_timeline(display_device, hasTimelineSemaphores(*cod, display_device)), cod(cod){
     // TODO automatically find correct queue and not choose 0 forcibly
     device_dispatch[GetKey(device)].GetDeviceQueue(device, 0, 0, &render_queue);
     device_dispatch[GetKey(display_device)].GetDeviceQueue(display_device, myInstance.displayQueueFamilyIndex, 0, &display_queue);
@@ -484,70 +1435,281 @@ struct PrimusSwapchain{
 
     instance_dispatch[GetKey(myInstance.instance)].GetPhysicalDeviceSurfaceCapabilitiesKHR(myInstance.display, pCreateInfo->surface, &surfaceCapabilities);
     TRACE("Min Images: " << surfaceCapabilities.minImageCount);
-    char *max_fps_env = getenv("PRIMUS_VK_MAX_FPS");
-    if(max_fps_env != nullptr){
-      max_fps = std::stoi(std::string{max_fps_env});
+    if(backend == VK_NULL_HANDLE){
+      virtual_display.reset(new VirtualDisplay(display_device, hasTimelineSemaphores(*cod, display_device), display_queue, displayQueueMutex, virtualDisplayRefresh(), pCreateInfo,
+	[this](uint32_t bits){ return getImageMemory(ImageType::DISPLAY_IMAGE, bits); }));
+      // One image is always on screen.
+      surfaceCapabilities.minImageCount = std::max(surfaceCapabilities.minImageCount, 2u);
+      TRACE("Virtual display at " << virtualDisplayRefresh() << " Hz");
     }
+    setupPacing();
+    setupTimestamps();
     if(getenv("PVK_SUPPRESS_SUBOPTIMAL")){
       suppress_suboptimal = true;
     }
+    char *drop_env = getenv("PRIMUS_VK_DROP_FRAMES");
+    if(drop_env != nullptr && std::string{drop_env} == "1"){
+      drop_frames = true;
+      TRACE("Dropping frames the display falls behind on.");
+    }
+
+    TRACE("Host copy kernel: " << selectCopyKernel().name << ", copy threads: " << CopyPool::shared().threadCount() + 1);
 
     uint32_t image_count;
-    device_dispatch[GetKey(display_device)].GetSwapchainImagesKHR(display_device, backend, &image_count, nullptr);
-    TRACE("Image aquiring: " << image_count);
-    std::vector<VkImage> display_images;
-    display_images.resize(image_count);
-    device_dispatch[GetKey(display_device)].GetSwapchainImagesKHR(display_device, backend, &image_count, display_images.data());
+    if(virtual_display){
+      display_images = virtual_display->handles();
+      image_count = display_images.size();
+    }else{
+      device_dispatch[GetKey(display_device)].GetSwapchainImagesKHR(display_device, backend, &image_count, nullptr);
+      TRACE("Image aquiring: " << image_count);
+      display_images.resize(image_count);
+      device_dispatch[GetKey(display_device)].GetSwapchainImagesKHR(display_device, backend, &image_count, display_images.data());
+    }
+    display_contents.assign(image_count, {UINT32_MAX, 0});
 
     imgSize = pCreateInfo->imageExtent;
-
-    for(uint32_t i = 0; i < image_count; i++){
-      images.emplace_back(*this, display_images[i], *pCreateInfo);
+    format = pCreateInfo->imageFormat;
+
+    // PRIMUS_VK_RENDER_IMAGES sizes the pool the application renders to
+    // independently of the display swapchain: 2 for low latency, more to
+    // keep the copy busy. Never fewer than the application asked for.
+    uint32_t render_count = image_count;
+    char *render_images_env = getenv("PRIMUS_VK_RENDER_IMAGES");
+    if(render_images_env != nullptr){
+      render_count = std::max(1, std::stoi(std::string{render_images_env}));
     }
+    render_count = std::max(render_count, app_images);
+    TRACE("Render images: " << render_count << ", display images: " << image_count);
 
-    TRACE("Creating a Swapchain thread.");
-    size_t thread_count = 1;
-    char *m_env = getenv("PRIMUS_VK_MULTITHREADING");
-    if(m_env == nullptr || std::string{m_env} != "1"){
-      thread_count = image_count;
+    selectTransfer(pCreateInfo, render_count);
+
+    if(old != nullptr && !old->retired){
+      TRACE("Taking over the staging images of the old swapchain.");
+      old->retire();
+    }else{
+      old = nullptr;
     }
-    threads.resize(thread_count);
-    for(auto &thread: threads){
-      thread = std::unique_ptr<std::thread>(new std::thread([this](){this->run();}));
-      pthread_setname_np(thread->native_handle(), "swapchain-thread");
+    images.reserve(render_count);
+    for(uint32_t i = 0; i < render_count; i++){
+      ImageWorker *donor = old != nullptr && i < old->images.size() ? &old->images[i] : nullptr;
+      images.emplace_back(*this, donor);
+      free_images.push_back(i);
     }
+    // Acquiring more than this without presenting is not allowed.
+    max_acquired = std::max(1u, image_count + 1 - std::min(image_count, surfaceCapabilities.minImageCount));
+
+    // The free images keep at most render_count frames in flight.
+    presents = std::unique_ptr<PresentRing<QueueItem>>(new PresentRing<QueueItem>(render_count));
+    TRACE("Present threads: " << PresentExecutor::shared().threadCount());
+    stats = telemetry::Publisher::shared().claim(imgSize.width, imgSize.height);
+    executor_entry = PresentExecutor::shared().add(this);
   }
 
   uint32_t getImageMemory(ImageType type, uint32_t memory_type_bits);
+  bool canUseZeroCopy();
+  std::shared_ptr<SharedHostBuffer> createSharedBuffer();
+  void setupPacing();
+  void setupTimestamps();
+  void selectTransfer(const VkSwapchainCreateInfoKHR *pCreateInfo, uint32_t image_count);
+  void selectTransferSize(const VkSwapchainCreateInfoKHR *pCreateInfo);
+  bool isScaled() const {
+    return transferSize.width != imgSize.width || transferSize.height != imgSize.height;
+  }
+  uint32_t bandRow(uint32_t band) const {
+    return std::min(band * band_rows, transferSize.height);
+  }
+  VkExtent2D bandExtent(uint32_t band) const {
+    return VkExtent2D{transferSize.width, bandRow(band + 1) - bandRow(band)};
+  }
 
-  void storeImage(uint32_t index, VkQueue queue, std::vector<VkSemaphore> wait_on, Fence &notify);
+  void storeImage(uint32_t index, VkQueue queue, const VkSemaphore *wait, uint32_t waitCount);
+  void submitDisplay(CommandBuffer &cmd, VkSemaphore wait, VkSemaphore signal, uint64_t &done);
 
-  void queue(VkQueue queue, const VkPresentInfoKHR *pPresentInfo);
+  VkResult queue(VkQueue queue, const VkPresentInfoKHR *pPresentInfo);
+  void prepareImages();
+  void retire();
 
-  std::mutex queueMutex;
-  std::condition_variable has_work;
-  bool active = true;
   struct QueueItem {
     VkQueue queue;
-    VkPresentInfoKHR pPresentInfo;
     uint32_t imgIndex;
+    // When the application presented it, in FramePacer::now() time.
+    uint64_t queued_at;
   };
-  std::list<QueueItem> work;
-  std::list<QueueItem> in_progress;
-  void present(const QueueItem &workItem);
-  void run();
+  std::unique_ptr<PresentRing<QueueItem>> presents;
+  PresentExecutor::Handle executor_entry;
+  void present(const QueueItem &workItem, uint32_t ticket);
+  bool presentNext() override;
+  uint32_t backlog() override {
+    return presents->backlog();
+  }
   void stop();
-  void waitForReady();
+  bool takeImage(uint64_t timeout, uint32_t &index);
+  void releaseImage(uint32_t index);
+  void awaitAcquireTurn(uint32_t ticket);
+  bool acquireDisplayImage(uint32_t ticket, ImageWorker &image, uint32_t &target);
+  void reportStatus(VkResult res);
+  VkResult status();
+  void recordStage(telemetry::Stage stage, uint64_t ns){
+    if(stats != nullptr){
+      stats->stages[stage].record(ns);
+    }
+  }
+  void recordCopied(uint64_t bytes){
+    if(stats != nullptr){
+      stats->bytes_copied.fetch_add(bytes, std::memory_order_relaxed);
+    }
+  }
+  void recordSkipped(uint64_t bytes){
+    skipped_bytes.fetch_add(bytes, std::memory_order_relaxed);
+    if(stats != nullptr){
+      stats->bytes_skipped.fetch_add(bytes, std::memory_order_relaxed);
+    }
+  }
+  bool reuseDisplayImage(uint32_t target, uint32_t index, bool unchanged);
 };
 
-ImageWorker::ImageWorker(PrimusSwapchain &swapchain, VkImage display_image, const VkSwapchainCreateInfoKHR &createInfo): swapchain(swapchain), render_copy_fence(swapchain.device), display_semaphore(swapchain.display_device), display_image(display_image){
-  initImages(createInfo);
-  createCommandBuffers();
+ImageWorker::ImageWorker(PrimusSwapchain &swapchain, ImageWorker *donor): swapchain(swapchain), display_semaphore(swapchain.display_device), acquire_semaphore(swapchain.display_device){
+  if(donor != nullptr){
+    takeOver(*donor);
+  }
+  initRenderImage();
 }
 ImageWorker::~ImageWorker(){
-  if(display_command_fence){
-    display_command_fence->await();
+  if(display_done != 0){
+    swapchain.display_timeline.await(display_done);
+  }
+}
+
+// Adds the extensions needed to import host allocations to `extensions`.
+// Returns false if the device does not support them or
+// PRIMUS_VK_ZERO_COPY=0.
+bool enableHostImport(VkPhysicalDevice dev, std::vector<const char*> &extensions){
+  char *env = getenv("PRIMUS_VK_ZERO_COPY");
+  if(env != nullptr && std::string{env} == "0"){
+    return false;
+  }
+  auto &dispatch = instance_dispatch[GetKey(dev)];
+  uint32_t count = 0;
+  dispatch.EnumerateDeviceExtensionProperties(dev, nullptr, &count, nullptr);
+  std::vector<VkExtensionProperties> available(count);
+  dispatch.EnumerateDeviceExtensionProperties(dev, nullptr, &count, available.data());
+  auto supported = [&available](const char *name){
+    return std::any_of(available.begin(), available.end(), [name](const VkExtensionProperties &ext){ return strcmp(ext.extensionName, name) == 0; });
+  };
+  auto enable = [&extensions](const char *name){
+    if(std::none_of(extensions.begin(), extensions.end(), [name](const char *ext){ return strcmp(ext, name) == 0; })){
+      extensions.push_back(name);
+    }
+  };
+  if(!supported(VK_EXT_EXTERNAL_MEMORY_HOST_EXTENSION_NAME)){
+    return false;
+  }
+  // Core since Vulkan 1.1, only listed by older drivers.
+  if(supported(VK_KHR_EXTERNAL_MEMORY_EXTENSION_NAME)){
+    enable(VK_KHR_EXTERNAL_MEMORY_EXTENSION_NAME);
+  }
+  enable(VK_EXT_EXTERNAL_MEMORY_HOST_EXTENSION_NAME);
+  return true;
+}
+
+// Feature structs enableTimelineSemaphore() chains into a device's create
+// info; they must live until the device is created.
+struct TimelineFeatures {
+  VkPhysicalDeviceTimelineSemaphoreFeaturesKHR timeline;
+  VkPhysicalDeviceVulkan12Features vulkan12;
+};
+
+// Enables VK_KHR_timeline_semaphore on a device about to be created with
+// `createInfo`, a copy the layer owns. Feature structs of the application
+// are not written to: if its chain starts with one that leaves timeline
+// semaphores off, a copy in `features` replaces it; further down the chain
+// they cannot be replaced without copying structs of unknown size, so the
+// device goes without. Otherwise `features.timeline` is chained in.
+// Returns false if the device gets no timeline semaphores.
+bool enableTimelineSemaphore(VkPhysicalDevice dev, std::vector<const char*> &extensions, VkDeviceCreateInfo &createInfo, TimelineFeatures &features){
+  auto &dispatch = instance_dispatch[GetKey(dev)];
+  if(dispatch.GetPhysicalDeviceFeatures2 == nullptr){
+    return false;
+  }
+  uint32_t count = 0;
+  dispatch.EnumerateDeviceExtensionProperties(dev, nullptr, &count, nullptr);
+  std::vector<VkExtensionProperties> available(count);
+  dispatch.EnumerateDeviceExtensionProperties(dev, nullptr, &count, available.data());
+  if(std::none_of(available.begin(), available.end(), [](const VkExtensionProperties &ext){ return strcmp(ext.extensionName, VK_KHR_TIMELINE_SEMAPHORE_EXTENSION_NAME) == 0; })){
+    return false;
+  }
+  VkPhysicalDeviceTimelineSemaphoreFeaturesKHR supported = {.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_TIMELINE_SEMAPHORE_FEATURES_KHR};
+  VkPhysicalDeviceFeatures2 features2 = {.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2};
+  features2.pNext = &supported;
+  dispatch.GetPhysicalDeviceFeatures2(dev, &features2);
+  if(!supported.timelineSemaphore){
+    return false;
+  }
+  const VkBaseInStructure *app = reinterpret_cast<const VkBaseInStructure*>(createInfo.pNext);
+  while(app != nullptr && app->sType != VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES
+	&& app->sType != VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_TIMELINE_SEMAPHORE_FEATURES_KHR){
+    app = app->pNext;
+  }
+  if(app == nullptr){
+    features.timeline = {.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_TIMELINE_SEMAPHORE_FEATURES_KHR};
+    features.timeline.timelineSemaphore = VK_TRUE;
+    features.timeline.pNext = const_cast<void*>(createInfo.pNext);
+    createInfo.pNext = &features.timeline;
+  }else if(app->sType == VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES){
+    features.vulkan12 = *reinterpret_cast<const VkPhysicalDeviceVulkan12Features*>(app);
+    if(!features.vulkan12.timelineSemaphore){
+      if(app != createInfo.pNext){
+	return false;
+      }
+      features.vulkan12.timelineSemaphore = VK_TRUE;
+      createInfo.pNext = &features.vulkan12;
+    }
+  }else{
+    features.timeline = *reinterpret_cast<const VkPhysicalDeviceTimelineSemaphoreFeaturesKHR*>(app);
+    if(!features.timeline.timelineSemaphore){
+      if(app != createInfo.pNext){
+	return false;
+      }
+      features.timeline.timelineSemaphore = VK_TRUE;
+      createInfo.pNext = &features.timeline;
+    }
+  }
+  if(std::none_of(extensions.begin(), extensions.end(), [](const char *ext){ return strcmp(ext, VK_KHR_TIMELINE_SEMAPHORE_EXTENSION_NAME) == 0; })){
+    extensions.push_back(VK_KHR_TIMELINE_SEMAPHORE_EXTENSION_NAME);
   }
+  return true;
+}
+
+// Adds VK_GOOGLE_display_timing to `extensions` if the device supports it
+// and PRIMUS_VK_PACE_TO_REFRESH=1.
+bool enableDisplayTiming(VkPhysicalDevice dev, std::vector<const char*> &extensions){
+  char *env = getenv("PRIMUS_VK_PACE_TO_REFRESH");
+  if(env == nullptr || std::string{env} != "1"){
+    return false;
+  }
+  auto &dispatch = instance_dispatch[GetKey(dev)];
+  uint32_t count = 0;
+  dispatch.EnumerateDeviceExtensionProperties(dev, nullptr, &count, nullptr);
+  std::vector<VkExtensionProperties> available(count);
+  dispatch.EnumerateDeviceExtensionProperties(dev, nullptr, &count, available.data());
+  if(std::none_of(available.begin(), available.end(), [](const VkExtensionProperties &ext){ return strcmp(ext.extensionName, VK_GOOGLE_DISPLAY_TIMING_EXTENSION_NAME) == 0; })){
+    TRACE("VK_GOOGLE_display_timing not available, pacing without the refresh cycle.");
+    return false;
+  }
+  extensions.push_back(VK_GOOGLE_DISPLAY_TIMING_EXTENSION_NAME);
+  return true;
+}
+
+VkDeviceSize hostImportAlignment(VkPhysicalDevice dev){
+  auto &dispatch = instance_dispatch[GetKey(dev)];
+  if(dispatch.GetPhysicalDeviceProperties2 == nullptr){
+    return 4096;
+  }
+  VkPhysicalDeviceExternalMemoryHostPropertiesEXT hostProps {.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_EXTERNAL_MEMORY_HOST_PROPERTIES_EXT};
+  VkPhysicalDeviceProperties2 props {.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2};
+  props.pNext = &hostProps;
+  dispatch.GetPhysicalDeviceProperties2(dev, &props);
+  return std::max<VkDeviceSize>(hostProps.minImportedHostPointerAlignment, 4096);
 }
 
 class CreateOtherDevice {
@@ -558,6 +1720,16 @@ public:
   VkPhysicalDeviceMemoryProperties render_mem;
   VkDevice render_gpu = VK_NULL_HANDLE;
   VkDevice display_gpu = VK_NULL_HANDLE;
+  // Both devices were created with VK_EXT_external_memory_host.
+  bool render_host_import = false;
+  bool display_host_import = false;
+  VkDeviceSize host_import_alignment = 4096;
+  // VK_GOOGLE_display_timing is enabled on the display device.
+  bool display_timing = false;
+  // Timeline semaphores are enabled, otherwise TimelineSemaphore falls
+  // back to fences.
+  bool render_timeline = false;
+  bool display_timeline = false;
 
   CreateOtherDevice(VkPhysicalDevice display_dev, VkPhysicalDevice render_dev):
     display_dev(display_dev), render_dev(render_dev){
@@ -571,6 +1743,9 @@ public:
     minstance_dispatch.GetPhysicalDeviceMemoryProperties(display_dev, &display_mem);
     minstance_dispatch.GetPhysicalDeviceMemoryProperties(render_dev, &render_mem);
 
+    if(render_host_import){
+      host_import_alignment = std::max(hostImportAlignment(display_dev), hostImportAlignment(render_dev));
+    }
     createDisplayDev(minstance_info, creator);
   }
   void createDisplayDev(InstanceInfo &my_instance, std::function<VkResult(VkDeviceCreateInfo &createInfo, VkDevice &dev)> creator){
@@ -586,9 +1761,18 @@ public:
 
     createInfo.queueCreateInfoCount = 1;
     createInfo.pQueueCreateInfos = &queueInfo;
-    createInfo.enabledExtensionCount = 1;
-    const char *swap[] = {VK_KHR_SWAPCHAIN_EXTENSION_NAME};
-    createInfo.ppEnabledExtensionNames = swap;
+    std::vector<const char*> extensions = {VK_KHR_SWAPCHAIN_EXTENSION_NAME};
+    if(render_host_import){
+      display_host_import = enableHostImport(display_dev, extensions);
+    }
+    TimelineFeatures timelineFeatures;
+    display_timeline = enableTimelineSemaphore(display_dev, extensions, createInfo, timelineFeatures);
+    if(!display_timeline){
+      TRACE("Display device without timeline semaphores, waiting for fences instead.");
+    }
+    display_timing = enableDisplayTiming(display_dev, extensions);
+    createInfo.enabledExtensionCount = extensions.size();
+    createInfo.ppEnabledExtensionNames = extensions.data();
     VkResult ret = creator(createInfo, display_gpu);
     TRACE("Creating display device finished!: " << ret);
     if(ret != VK_SUCCESS){
@@ -598,12 +1782,19 @@ public:
 };
 
 
+bool hasTimelineSemaphores(const CreateOtherDevice &cod, VkDevice device){
+  return device == cod.render_gpu ? cod.render_timeline : cod.display_timeline;
+}
+
 class CommandBuffer {
   VkCommandPool commandPool;
   VkDevice device;
+  bool labelled = false;
 public:
   VkCommandBuffer cmd;
-  CommandBuffer(VkDevice device, uint32_t queueFamilyIndex) : device(device) {
+  // `label` names the whole command buffer for GPU profilers and
+  // debuggers, when the instance has VK_EXT_debug_utils enabled.
+  CommandBuffer(VkDevice device, uint32_t queueFamilyIndex, const char *label = nullptr) : device(device) {
     VkCommandPoolCreateInfo poolInfo = {.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO};
     poolInfo.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
     poolInfo.queueFamilyIndex = queueFamilyIndex;
@@ -618,6 +1809,13 @@ public:
 
     VkCommandBufferBeginInfo cmdBufInfo = {.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO};
     VK_CHECK_RESULT(device_dispatch[GetKey(device)].BeginCommandBuffer(cmd, &cmdBufInfo));
+    auto &dispatch = device_dispatch[GetKey(device)];
+    if(label != nullptr && dispatch.CmdBeginDebugUtilsLabelEXT != nullptr && dispatch.CmdEndDebugUtilsLabelEXT != nullptr){
+      VkDebugUtilsLabelEXT info = {.sType = VK_STRUCTURE_TYPE_DEBUG_UTILS_LABEL_EXT};
+      info.pLabelName = label;
+      dispatch.CmdBeginDebugUtilsLabelEXT(cmd, &info);
+      labelled = true;
+    }
   }
   ~CommandBuffer(){
     device_dispatch[GetKey(device)].FreeCommandBuffers(device, commandPool, 1, &cmd);
@@ -649,25 +1847,114 @@ public:
 			 0, nullptr,
 			 1, &imageMemoryBarrier);
   }
-  void copyImage(VkImage src, VkImage dst, VkExtent2D imgSize){
+  // `y` selects the first row, for copying a band of `imgSize` rows.
+  void copyImage(VkImage src, VkImage dst, VkExtent2D imgSize, uint32_t y = 0,
+		 VkImageLayout srcLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, VkImageLayout dstLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL){
     VkImageCopy imageCopyRegion{};
     imageCopyRegion.srcSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
     imageCopyRegion.srcSubresource.layerCount = 1;
+    imageCopyRegion.srcOffset.y = y;
     imageCopyRegion.dstSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
     imageCopyRegion.dstSubresource.layerCount = 1;
+    imageCopyRegion.dstOffset.y = y;
     imageCopyRegion.extent.width = imgSize.width;
     imageCopyRegion.extent.height = imgSize.height;
     imageCopyRegion.extent.depth = 1;
 
     // Issue the copy command
     device_dispatch[GetKey(device)].CmdCopyImage(
+		   cmd,
+		   src, srcLayout,
+		   dst, dstLayout,
+		   1,
+		   &imageCopyRegion);
+  }
+  void insertBufferMemoryBarrier(
+				  VkBuffer buffer,
+				  VkAccessFlags srcAccessMask,
+				  VkAccessFlags dstAccessMask,
+				  VkPipelineStageFlags srcStageMask,
+				  VkPipelineStageFlags dstStageMask) {
+    VkBufferMemoryBarrier bufferMemoryBarrier{.sType=VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER};
+    bufferMemoryBarrier.srcAccessMask = srcAccessMask;
+    bufferMemoryBarrier.dstAccessMask = dstAccessMask;
+    bufferMemoryBarrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    bufferMemoryBarrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    bufferMemoryBarrier.buffer = buffer;
+    bufferMemoryBarrier.offset = 0;
+    bufferMemoryBarrier.size = VK_WHOLE_SIZE;
+
+    device_dispatch[GetKey(device)].CmdPipelineBarrier(
+			 cmd,
+			 srcStageMask,
+			 dstStageMask,
+			 0,
+			 0, nullptr,
+			 1, &bufferMemoryBarrier,
+			 0, nullptr);
+  }
+  void copyImageToBuffer(VkImage src, VkBuffer dst, VkExtent2D imgSize, uint32_t y = 0, VkDeviceSize bufferOffset = 0){
+    VkBufferImageCopy bufferCopyRegion{};
+    bufferCopyRegion.bufferOffset = bufferOffset;
+    bufferCopyRegion.imageOffset.y = y;
+    bufferCopyRegion.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    bufferCopyRegion.imageSubresource.layerCount = 1;
+    bufferCopyRegion.imageExtent.width = imgSize.width;
+    bufferCopyRegion.imageExtent.height = imgSize.height;
+    bufferCopyRegion.imageExtent.depth = 1;
+
+    device_dispatch[GetKey(device)].CmdCopyImageToBuffer(
+			   cmd,
+			   src, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+			   dst,
+			   1,
+			   &bufferCopyRegion);
+  }
+  void blitImage(VkImage src, VkExtent2D srcSize, VkImage dst, VkExtent2D dstSize, VkFilter filter){
+    VkImageBlit region{};
+    region.srcSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    region.srcSubresource.layerCount = 1;
+    region.srcOffsets[1] = VkOffset3D{int32_t(srcSize.width), int32_t(srcSize.height), 1};
+    region.dstSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    region.dstSubresource.layerCount = 1;
+    region.dstOffsets[1] = VkOffset3D{int32_t(dstSize.width), int32_t(dstSize.height), 1};
+
+    device_dispatch[GetKey(device)].CmdBlitImage(
 		   cmd,
 		   src, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
 		   dst, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
 		   1,
-		   &imageCopyRegion);
+		   &region,
+		   filter);
+  }
+  void copyBufferToImage(VkBuffer src, VkImage dst, VkExtent2D imgSize, uint32_t y = 0, VkDeviceSize bufferOffset = 0){
+    VkBufferImageCopy bufferCopyRegion{};
+    bufferCopyRegion.bufferOffset = bufferOffset;
+    bufferCopyRegion.imageOffset.y = y;
+    bufferCopyRegion.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    bufferCopyRegion.imageSubresource.layerCount = 1;
+    bufferCopyRegion.imageExtent.width = imgSize.width;
+    bufferCopyRegion.imageExtent.height = imgSize.height;
+    bufferCopyRegion.imageExtent.depth = 1;
+
+    device_dispatch[GetKey(device)].CmdCopyBufferToImage(
+			   cmd,
+			   src,
+			   dst, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+			   1,
+			   &bufferCopyRegion);
+  }
+  void dispatch(VkPipeline pipeline, VkPipelineLayout layout, VkDescriptorSet set, const void *pushConstants, uint32_t pushConstantsSize, uint32_t groupsX, uint32_t groupsY){
+    auto &dispatch = device_dispatch[GetKey(device)];
+    dispatch.CmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, pipeline);
+    dispatch.CmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, layout, 0, 1, &set, 0, nullptr);
+    dispatch.CmdPushConstants(cmd, layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, pushConstantsSize, pushConstants);
+    dispatch.CmdDispatch(cmd, groupsX, groupsY, 1);
   }
   void end(){
+    if(labelled){
+      device_dispatch[GetKey(device)].CmdEndDebugUtilsLabelEXT(cmd);
+    }
     VK_CHECK_RESULT(device_dispatch[GetKey(device)].EndCommandBuffer(cmd));
   }
   void submit(VkQueue queue, VkFence fence, std::vector<VkSemaphore> wait = {}, std::vector<VkSemaphore> signal = {}){
@@ -684,30 +1971,399 @@ public:
     // Submit to the queue
     VK_CHECK_RESULT(device_dispatch[GetKey(device)].QueueSubmit(queue, 1, &submitInfo, fence));
   }
-};
+  // Like submit(), but signals `timeline` to `value` instead of a fence, and
+  // `signal` unless it is VK_NULL_HANDLE. With timeline semaphores it does
+  // not allocate once waitStages is large enough.
+  void submit(VkQueue queue, const VkSemaphore *wait, uint32_t waitCount, VkSemaphore signal, TimelineSemaphore &timeline, uint64_t value,
+	      VkPipelineStageFlags waitStage = VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT){
+    waitStages.assign(waitCount, waitStage);
+    VkSubmitInfo submitInfo = {.sType=VK_STRUCTURE_TYPE_SUBMIT_INFO};
+    submitInfo.commandBufferCount = 1;
+    submitInfo.pCommandBuffers = &cmd;
+    submitInfo.pWaitDstStageMask = waitStages.data();
+    submitInfo.waitSemaphoreCount = waitCount;
+    submitInfo.pWaitSemaphores = wait;
+
+    VK_CHECK_RESULT(timeline.submit(queue, submitInfo, signal, value));
+  }
+private:
+  std::vector<VkPipelineStageFlags> waitStages;
+};
+
+// Measures on the GPU how long the layer's commands in a command buffer
+// take. The command buffer resets the queries itself, so it can be
+// submitted again without the host; read() gets the duration of the last
+// submission once the GPU is done with it.
+class GpuTimer{
+  VkDevice device;
+  VkQueryPool pool = VK_NULL_HANDLE;
+  double period;
+  uint64_t mask;
+  // The queries may only be read once a command buffer reset them.
+  bool submitted = false;
+public:
+  GpuTimer(VkDevice device, const TimestampInfo &info): device(device), period(info.period),
+    mask(info.valid_bits >= 64 ? ~uint64_t{0} : (uint64_t{1} << info.valid_bits) - 1){
+    VkQueryPoolCreateInfo poolInfo = {.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO};
+    poolInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
+    poolInfo.queryCount = 2;
+    VK_CHECK_RESULT(device_dispatch[GetKey(device)].CreateQueryPool(device, &poolInfo, nullptr, &pool));
+  }
+  GpuTimer(const GpuTimer &) = delete;
+  ~GpuTimer(){
+    device_dispatch[GetKey(device)].DestroyQueryPool(device, pool, nullptr);
+  }
+  void begin(CommandBuffer &cmd){
+    device_dispatch[GetKey(device)].CmdResetQueryPool(cmd.cmd, pool, 0, 2);
+    device_dispatch[GetKey(device)].CmdWriteTimestamp(cmd.cmd, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, pool, 0);
+  }
+  void end(CommandBuffer &cmd){
+    device_dispatch[GetKey(device)].CmdWriteTimestamp(cmd.cmd, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, pool, 1);
+  }
+  // A command buffer with begin() was submitted.
+  void markSubmitted(){
+    submitted = true;
+  }
+  // Nanoseconds between begin() and end(); false while the GPU did not
+  // finish the last submission.
+  bool read(uint64_t &ns){
+    uint64_t ticks[2];
+    if(!submitted || device_dispatch[GetKey(device)].GetQueryPoolResults(device, pool, 0, 2, sizeof(ticks), ticks, sizeof(uint64_t), VK_QUERY_RESULT_64_BIT) != VK_SUCCESS){
+      return false;
+    }
+    ns = uint64_t(((ticks[1] - ticks[0]) & mask) * period);
+    return true;
+  }
+};
+
+// Optional compute pass on the render GPU (PRIMUS_VK_DIRTY_TILES=1) that
+// marks the tiles which changed since the last frame copied through the same
+// ImageWorker. The host copy then only touches the dirty tiles.
+struct DirtyTiles {
+  static constexpr uint32_t tile_size = 32;
+  static constexpr size_t bytes_per_pixel = 4;
+  struct PushConstants {
+    uint32_t width;
+    uint32_t height;
+    uint32_t tilesX;
+  };
+  ComputePipeline &pipeline;
+  VkExtent2D size;
+  uint32_t tilesX;
+  uint32_t tilesY;
+  // Scratch copy of the new frame and the frame last copied to the host.
+  std::shared_ptr<FramebufferBuffer> current;
+  std::shared_ptr<FramebufferBuffer> previous;
+  // One word per tile, non-zero if the tile changed. Host visible.
+  std::shared_ptr<FramebufferBuffer> map;
+  VkDescriptorSet set;
+  // Set once the display source image holds the contents of `previous`,
+  // before that every frame is copied in full.
+  bool valid = false;
+
+  // nullptr without compute shaders.
+  static std::unique_ptr<ComputePipeline> createPipeline(VkDevice device, uint32_t maxSets){
+#ifdef PRIMUS_VK_SHADERS
+    return std::unique_ptr<ComputePipeline>(new ComputePipeline(device, primus_vk_dirty_spv, sizeof(primus_vk_dirty_spv), 3, sizeof(PushConstants), maxSets));
+#else
+    return nullptr;
+#endif
+  }
+  // The shader compares whole texels as 32 bit words.
+  static bool supportsFormat(VkFormat format){
+    return formatBytesPerPixel(format) == 4;
+  }
+
+  DirtyTiles(DirtyTiles &) = delete;
+  DirtyTiles(ComputePipeline &pipeline, VkDevice device, VkExtent2D size, std::function<uint32_t(ImageType type, uint32_t memory_type_bits)> memoryTypeIndex):
+    pipeline(pipeline), size(size){
+    tilesX = (size.width + tile_size - 1) / tile_size;
+    tilesY = (size.height + tile_size - 1) / tile_size;
+    const VkDeviceSize frameBytes = VkDeviceSize{size.width} * size.height * bytes_per_pixel;
+    auto deviceLocal = [memoryTypeIndex](uint32_t memoryTypeBits){ return memoryTypeIndex(ImageType::RENDER_TARGET_IMAGE, memoryTypeBits); };
+    current = std::make_shared<FramebufferBuffer>(device, frameBytes, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, deviceLocal);
+    previous = std::make_shared<FramebufferBuffer>(device, frameBytes, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, deviceLocal);
+    map = std::make_shared<FramebufferBuffer>(device, VkDeviceSize{tilesX} * tilesY * sizeof(uint32_t), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+      [memoryTypeIndex](uint32_t memoryTypeBits){ return memoryTypeIndex(ImageType::RENDER_COPY_IMAGE, memoryTypeBits); });
+    map->map();
+    set = pipeline.allocateSet({current->buf, previous->buf, map->buf});
+  }
+  // Expects `src` in TRANSFER_SRC_OPTIMAL layout.
+  void record(CommandBuffer &cmd, VkImage src){
+    cmd.insertBufferMemoryBarrier(current->buf,
+	VK_ACCESS_SHADER_READ_BIT,		VK_ACCESS_TRANSFER_WRITE_BIT,
+	VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,	VK_PIPELINE_STAGE_TRANSFER_BIT);
+    cmd.copyImageToBuffer(src, current->buf, size);
+    cmd.insertBufferMemoryBarrier(current->buf,
+	VK_ACCESS_TRANSFER_WRITE_BIT,		VK_ACCESS_SHADER_READ_BIT,
+	VK_PIPELINE_STAGE_TRANSFER_BIT,		VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT);
+    cmd.insertBufferMemoryBarrier(previous->buf,
+	VK_ACCESS_SHADER_WRITE_BIT,		VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT,
+	VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,	VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT);
+    cmd.insertBufferMemoryBarrier(map->buf,
+	VK_ACCESS_HOST_READ_BIT,		VK_ACCESS_SHADER_WRITE_BIT,
+	VK_PIPELINE_STAGE_HOST_BIT,		VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT);
+    PushConstants params{size.width, size.height, tilesX};
+    cmd.dispatch(pipeline.pipeline, pipeline.layout, set, &params, sizeof(params), tilesX, tilesY);
+    cmd.insertBufferMemoryBarrier(map->buf,
+	VK_ACCESS_SHADER_WRITE_BIT,		VK_ACCESS_HOST_READ_BIT,
+	VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,	VK_PIPELINE_STAGE_HOST_BIT);
+  }
+  // Number of dirty tiles of the last frame. Call after the render copy
+  // finished.
+  size_t countDirty(){
+    map->invalidate();
+    const uint32_t *flags = reinterpret_cast<const uint32_t*>(map->getMapped()->data);
+    return std::count_if(flags, flags + size_t{tilesX} * tilesY, [](uint32_t flag){ return flag != 0; });
+  }
+  size_t tileCount() const {
+    return size_t{tilesX} * tilesY;
+  }
+  // Copies the dirty tiles, one run of neighbouring dirty tiles at a time.
+  // Returns the number of bytes copied.
+  size_t copy(const CopyKernel &kernel, char *dst, size_t dstPitch, const char *src, size_t srcPitch){
+    const uint32_t *flags = reinterpret_cast<const uint32_t*>(map->getMapped()->data);
+    const uint32_t tile = tile_size;
+    size_t copied = 0;
+    for(uint32_t ty = 0; ty < tilesY; ty++){
+      const size_t y = size_t{ty} * tile;
+      const size_t rows = std::min<size_t>(tile, size.height - y);
+      const uint32_t *row = flags + size_t{ty} * tilesX;
+      for(uint32_t tx = 0; tx < tilesX;){
+	if(row[tx] == 0){
+	  tx++;
+	  continue;
+	}
+	uint32_t end = tx;
+	while(end < tilesX && row[end] != 0){
+	  end++;
+	}
+	const size_t x = size_t{tx} * tile * bytes_per_pixel;
+	const size_t bytes = std::min<size_t>(size_t{end} * tile, size.width) * bytes_per_pixel - x;
+	kernel.copyRows(dst + y * dstPitch + x, dstPitch, src + y * srcPitch + x, srcPitch, bytes, rows);
+	copied += bytes * rows;
+	tx = end;
+      }
+    }
+    return copied;
+  }
+};
+
+// Opt-in transfer format (PRIMUS_VK_TRANSFER_FORMAT=yuv420): the render GPU
+// converts the frame to planar YUV 4:2:0 before the readback and the display
+// GPU expands it again, so 1.5 instead of 4 bytes per pixel go through host
+// memory. Chroma is shared between 2x2 pixels, fine colored detail is lost.
+struct YuvTransfer {
+  struct PushConstants {
+    uint32_t width;
+    uint32_t height;
+    uint32_t lumaPitch;
+    uint32_t bgr;
+  };
+  ComputePipeline &encode;
+  ComputePipeline &decode;
+  VkExtent2D size;
+  PushConstants params;
+  VkDeviceSize packedSize;
+  // Render side: the frame as copied out of the render image and its
+  // packed YUV version, which is read by the host.
+  std::shared_ptr<FramebufferBuffer> render_frame;
+  std::shared_ptr<FramebufferBuffer> render_packed;
+  // Display side: the packed frame written by the host and the expanded
+  // frame that is copied into the swapchain image.
+  std::shared_ptr<FramebufferBuffer> display_packed;
+  std::shared_ptr<FramebufferBuffer> display_frame;
+  VkDescriptorSet encode_set;
+  VkDescriptorSet decode_set;
+
+  static bool supportsFormat(VkFormat format){
+    switch(format){
+    case VK_FORMAT_B8G8R8A8_UNORM:
+    case VK_FORMAT_B8G8R8A8_SRGB:
+    case VK_FORMAT_R8G8B8A8_UNORM:
+    case VK_FORMAT_R8G8B8A8_SRGB:
+      return true;
+    default:
+      return false;
+    }
+  }
+  // Both nullptr without compute shaders.
+  static std::unique_ptr<ComputePipeline> createEncodePipeline(VkDevice device, uint32_t maxSets){
+#ifdef PRIMUS_VK_SHADERS
+    return std::unique_ptr<ComputePipeline>(new ComputePipeline(device, primus_vk_yuv_encode_spv, sizeof(primus_vk_yuv_encode_spv), 2, sizeof(PushConstants), maxSets));
+#else
+    return nullptr;
+#endif
+  }
+  static std::unique_ptr<ComputePipeline> createDecodePipeline(VkDevice device, uint32_t maxSets){
+#ifdef PRIMUS_VK_SHADERS
+    return std::unique_ptr<ComputePipeline>(new ComputePipeline(device, primus_vk_yuv_decode_spv, sizeof(primus_vk_yuv_decode_spv), 2, sizeof(PushConstants), maxSets));
+#else
+    return nullptr;
+#endif
+  }
+
+  YuvTransfer(YuvTransfer &) = delete;
+  YuvTransfer(ComputePipeline &encode, ComputePipeline &decode, VkDevice render_device, VkDevice display_device, VkExtent2D size, VkFormat format,
+	      std::function<uint32_t(ImageType type, uint32_t memory_type_bits)> memoryTypeIndex):
+    encode(encode), decode(decode), size(size){
+    const uint32_t lumaPitch = (size.width + 7) / 8 * 8;
+    const uint32_t paddedHeight = (size.height + 1) / 2 * 2;
+    params = PushConstants{size.width, size.height, lumaPitch,
+      format == VK_FORMAT_B8G8R8A8_UNORM || format == VK_FORMAT_B8G8R8A8_SRGB ? 1u : 0u};
+    packedSize = VkDeviceSize{lumaPitch} * paddedHeight * 3 / 2;
+    const VkDeviceSize frameSize = VkDeviceSize{size.width} * size.height * 4;
+
+    auto memory = [memoryTypeIndex](ImageType type){
+      return [memoryTypeIndex, type](uint32_t memoryTypeBits){ return memoryTypeIndex(type, memoryTypeBits); };
+    };
+    render_frame = std::make_shared<FramebufferBuffer>(render_device, frameSize, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, memory(ImageType::RENDER_TARGET_IMAGE));
+    render_packed = std::make_shared<FramebufferBuffer>(render_device, packedSize, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, memory(ImageType::RENDER_COPY_IMAGE));
+    display_packed = std::make_shared<FramebufferBuffer>(display_device, packedSize, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, memory(ImageType::DISPLAY_IMAGE));
+    display_frame = std::make_shared<FramebufferBuffer>(display_device, frameSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, memory(ImageType::DISPLAY_SCRATCH));
+    render_packed->map();
+    display_packed->map();
+    encode_set = encode.allocateSet({render_frame->buf, render_packed->buf});
+    decode_set = decode.allocateSet({display_packed->buf, display_frame->buf});
+  }
+  // Expects `src` in TRANSFER_SRC_OPTIMAL layout.
+  void recordEncode(CommandBuffer &cmd, VkImage src){
+    cmd.insertBufferMemoryBarrier(render_frame->buf,
+	VK_ACCESS_SHADER_READ_BIT,		VK_ACCESS_TRANSFER_WRITE_BIT,
+	VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,	VK_PIPELINE_STAGE_TRANSFER_BIT);
+    cmd.copyImageToBuffer(src, render_frame->buf, size);
+    cmd.insertBufferMemoryBarrier(render_frame->buf,
+	VK_ACCESS_TRANSFER_WRITE_BIT,		VK_ACCESS_SHADER_READ_BIT,
+	VK_PIPELINE_STAGE_TRANSFER_BIT,		VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT);
+    cmd.insertBufferMemoryBarrier(render_packed->buf,
+	VK_ACCESS_HOST_READ_BIT,		VK_ACCESS_SHADER_WRITE_BIT,
+	VK_PIPELINE_STAGE_HOST_BIT,		VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT);
+    const uint32_t blocksX = params.lumaPitch / 8;
+    const uint32_t blocksY = (size.height + 1) / 2;
+    cmd.dispatch(encode.pipeline, encode.layout, encode_set, &params, sizeof(params), (blocksX + 7) / 8, (blocksY + 7) / 8);
+    cmd.insertBufferMemoryBarrier(render_packed->buf,
+	VK_ACCESS_SHADER_WRITE_BIT,		VK_ACCESS_HOST_READ_BIT,
+	VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,	VK_PIPELINE_STAGE_HOST_BIT);
+  }
+  // Expects `dst` in TRANSFER_DST_OPTIMAL layout.
+  void recordDecode(CommandBuffer &cmd, VkImage dst){
+    cmd.insertBufferMemoryBarrier(display_packed->buf,
+	VK_ACCESS_HOST_WRITE_BIT,		VK_ACCESS_SHADER_READ_BIT,
+	VK_PIPELINE_STAGE_HOST_BIT,		VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT);
+    cmd.insertBufferMemoryBarrier(display_frame->buf,
+	VK_ACCESS_TRANSFER_READ_BIT,		VK_ACCESS_SHADER_WRITE_BIT,
+	VK_PIPELINE_STAGE_TRANSFER_BIT,		VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT);
+    cmd.dispatch(decode.pipeline, decode.layout, decode_set, &params, sizeof(params), (size.width + 15) / 16, (size.height + 15) / 16);
+    cmd.insertBufferMemoryBarrier(display_frame->buf,
+	VK_ACCESS_SHADER_WRITE_BIT,		VK_ACCESS_TRANSFER_READ_BIT,
+	VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,	VK_PIPELINE_STAGE_TRANSFER_BIT);
+    // The host writes the next frame into display_packed only after waiting
+    // for display_done, that orders it after the shader read.
+    cmd.copyBufferToImage(display_frame->buf, dst, size);
+  }
+};
+
+// A donor that never got prepared still has its own spares. The render
+// image stays with the donor: the application may still render to it and
+// get it from vkGetSwapchainImagesKHR until it destroys the old swapchain.
+void ImageWorker::takeOver(ImageWorker &donor){
+  spares.render_scaled_image = takeFromDonor(donor.render_scaled_image, donor.spares.render_scaled_image);
+  spares.display_scaled_image = takeFromDonor(donor.display_scaled_image, donor.spares.display_scaled_image);
+  spares.render_copy_image = takeFromDonor(donor.render_copy_image, donor.spares.render_copy_image);
+  spares.display_src_image = takeFromDonor(donor.display_src_image, donor.spares.display_src_image);
+  spares.render_copy_buffer = takeFromDonor(donor.render_copy_buffer, donor.spares.render_copy_buffer);
+  spares.display_src_buffer = takeFromDonor(donor.display_src_buffer, donor.spares.display_src_buffer);
+  spares.shared_buffer = takeFromDonor(donor.shared_buffer, donor.spares.shared_buffer);
+}
+
+void ImageWorker::initRenderImage(){
+  render_image = std::make_shared<FramebufferImage>(swapchain.device, swapchain.imgSize,
+    VK_IMAGE_TILING_OPTIMAL, VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT, swapchain.format,
+    [this](uint32_t memoryTypeBits){ return swapchain.getImageMemory(ImageType::RENDER_TARGET_IMAGE, memoryTypeBits); });
+}
+
+// Layout transitions are recorded into `setup`, which the swapchain submits
+// once for all images.
+void ImageWorker::initImages(CommandBuffer &setup){
+  auto format = swapchain.format;
+  // Images are only taken over with the same size, buffers and host
+  // allocations whenever they are large enough.
+  auto takeImage = [format](std::shared_ptr<FramebufferImage> &mine, std::shared_ptr<FramebufferImage> &spare, VkExtent2D size){
+    return takeSpare(mine, spare, [&](const FramebufferImage &image){ return image.matches(size, format); });
+  };
+  auto takeBuffer = [](std::shared_ptr<FramebufferBuffer> &mine, std::shared_ptr<FramebufferBuffer> &spare, VkDeviceSize size){
+    return takeSpare(mine, spare, [size](const FramebufferBuffer &buffer){ return buffer.size >= size; });
+  };
 
-void ImageWorker::initImages( const VkSwapchainCreateInfoKHR &createInfo){
-  auto imgSize = createInfo.imageExtent;
-  auto format = createInfo.imageFormat;
-    
-  auto &renderImage = render_image;
   auto &renderCopyImage = render_copy_image;
   auto &displaySrcImage = display_src_image;
-  renderImage = std::make_shared<FramebufferImage>(swapchain.device, imgSize,
-    VK_IMAGE_TILING_OPTIMAL, VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT, format,
-    [this](uint32_t memoryTypeBits){ return swapchain.getImageMemory(ImageType::RENDER_TARGET_IMAGE, memoryTypeBits); });
-  renderCopyImage = std::make_shared<FramebufferImage>(swapchain.device, imgSize,
-    VK_IMAGE_TILING_LINEAR, VK_IMAGE_USAGE_TRANSFER_DST_BIT, format,
-    [this](uint32_t memoryTypeBits){ return swapchain.getImageMemory(ImageType::RENDER_COPY_IMAGE, memoryTypeBits); });
+  if(swapchain.isScaled()){
+    if(!takeImage(render_scaled_image, spares.render_scaled_image, swapchain.transferSize)){
+      render_scaled_image = std::make_shared<FramebufferImage>(swapchain.device, swapchain.transferSize,
+	VK_IMAGE_TILING_OPTIMAL, VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT, format,
+	[this](uint32_t memoryTypeBits){ return swapchain.getImageMemory(ImageType::RENDER_TARGET_IMAGE, memoryTypeBits); });
+    }
+    if(!takeImage(display_scaled_image, spares.display_scaled_image, swapchain.transferSize)){
+      display_scaled_image = std::make_shared<FramebufferImage>(swapchain.display_device, swapchain.transferSize,
+	VK_IMAGE_TILING_OPTIMAL, VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT, format,
+	[this](uint32_t memoryTypeBits){ return swapchain.getImageMemory(ImageType::DISPLAY_SCRATCH, memoryTypeBits); });
+    }
+  }
+  auto imgSize = swapchain.transferSize;
+
+  if(swapchain.yuv_encode_pipeline){
+    yuv = std::unique_ptr<YuvTransfer>(new YuvTransfer(*swapchain.yuv_encode_pipeline, *swapchain.yuv_decode_pipeline,
+      swapchain.device, swapchain.display_device, imgSize, format,
+      [this](ImageType type, uint32_t memoryTypeBits){ return swapchain.getImageMemory(type, memoryTypeBits); }));
+    return;
+  }
+
+  if(swapchain.zero_copy){
+    const VkDeviceSize frameSize = VkDeviceSize{imgSize.width} * imgSize.height * swapchain.bytes_per_pixel;
+    auto fits = [frameSize](const SharedHostBuffer &buffer){ return buffer.size >= frameSize; };
+    if(!takeSpare(shared_buffer, spares.shared_buffer, fits) && !takeSpare(shared_buffer, swapchain.zero_copy_probe, fits)){
+      // The import worked for the probe, failing now is out of memory.
+      shared_buffer = swapchain.createSharedBuffer();
+    }
+    return;
+  }
+
+  if(swapchain.dirty_pipeline){
+    dirty = std::unique_ptr<DirtyTiles>(new DirtyTiles(*swapchain.dirty_pipeline, swapchain.device, imgSize,
+      [this](ImageType type, uint32_t memoryTypeBits){ return swapchain.getImageMemory(type, memoryTypeBits); }));
+  }
+
+  if(swapchain.buffer_staging){
+    const VkDeviceSize frameSize = VkDeviceSize{imgSize.width} * imgSize.height * swapchain.bytes_per_pixel;
+    if(!takeBuffer(render_copy_buffer, spares.render_copy_buffer, frameSize)){
+      render_copy_buffer = std::make_shared<FramebufferBuffer>(swapchain.device, frameSize, VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+	[this](uint32_t memoryTypeBits){ return swapchain.getImageMemory(ImageType::RENDER_COPY_IMAGE, memoryTypeBits); });
+      render_copy_buffer->map();
+    }
+    if(!takeBuffer(display_src_buffer, spares.display_src_buffer, frameSize)){
+      display_src_buffer = std::make_shared<FramebufferBuffer>(swapchain.display_device, frameSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+	[this](uint32_t memoryTypeBits){ return swapchain.getImageMemory(ImageType::DISPLAY_IMAGE, memoryTypeBits); });
+      display_src_buffer->map();
+    }
+    return;
+  }
+
+  if(!takeImage(renderCopyImage, spares.render_copy_image, imgSize)){
+    renderCopyImage = std::make_shared<FramebufferImage>(swapchain.device, imgSize,
+      VK_IMAGE_TILING_LINEAR, VK_IMAGE_USAGE_TRANSFER_DST_BIT, format,
+      [this](uint32_t memoryTypeBits){ return swapchain.getImageMemory(ImageType::RENDER_COPY_IMAGE, memoryTypeBits); });
+    renderCopyImage->map();
+  }
+  // A taken over source image is already in GENERAL layout.
+  if(takeImage(displaySrcImage, spares.display_src_image, imgSize)){
+    return;
+  }
   displaySrcImage = std::make_shared<FramebufferImage>(swapchain.display_device, imgSize,
     VK_IMAGE_TILING_LINEAR, VK_IMAGE_USAGE_TRANSFER_SRC_BIT, format,
     [this](uint32_t memoryTypeBits){ return swapchain.getImageMemory(ImageType::DISPLAY_IMAGE, memoryTypeBits); });
-
-  renderCopyImage->map();
   displaySrcImage->map();
 
-  CommandBuffer cmd{swapchain.display_device, swapchain.myInstance.displayQueueFamilyIndex};
-  cmd.insertImageMemoryBarrier(
+  setup.insertImageMemoryBarrier(
 			       displaySrcImage->img,
 			       0,
 			       VK_ACCESS_MEMORY_WRITE_BIT,
@@ -716,10 +2372,6 @@ void ImageWorker::initImages( const VkSwapchainCreateInfoKHR &createInfo){
 			       VK_PIPELINE_STAGE_TRANSFER_BIT,
 			       VK_PIPELINE_STAGE_TRANSFER_BIT,
 			       VkImageSubresourceRange{ VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 });
-  cmd.end();
-  Fence f{swapchain.display_device};
-  cmd.submit(swapchain.display_queue, f.fence);
-  f.await();
 }
 
 
@@ -757,6 +2409,16 @@ VkResult VKAPI_CALL PrimusVK_CreateDevice(
     scoped_lock l(global_lock);
     cod = std::make_shared<CreateOtherDevice>(display_dev, physicalDevice);
   }
+  VkDeviceCreateInfo renderCreateInfo = *pCreateInfo;
+  std::vector<const char*> renderExtensions{pCreateInfo->ppEnabledExtensionNames, pCreateInfo->ppEnabledExtensionNames + pCreateInfo->enabledExtensionCount};
+  cod->render_host_import = enableHostImport(physicalDevice, renderExtensions);
+  TimelineFeatures renderTimelineFeatures;
+  cod->render_timeline = enableTimelineSemaphore(physicalDevice, renderExtensions, renderCreateInfo, renderTimelineFeatures);
+  if(!cod->render_timeline){
+    TRACE("Render device without timeline semaphores, waiting for fences instead.");
+  }
+  renderCreateInfo.enabledExtensionCount = renderExtensions.size();
+  renderCreateInfo.ppEnabledExtensionNames = renderExtensions.data();
   auto createDevice = my_instance_info.layerCreateDevice;
   cod->finish([createDevice,&my_instance_info](VkDeviceCreateInfo &createInfo, VkDevice &dev){
     PFN_vkGetDeviceProcAddr gdpa = nullptr;
@@ -765,11 +2427,14 @@ VkResult VKAPI_CALL PrimusVK_CreateDevice(
       scoped_lock l(global_lock);
       device_instance_info[GetKey(dev)] = &my_instance_info;
       device_dispatch.insert({GetKey(dev),fetchDispatchTable(gdpa, &dev)});
+      if(ret == VK_SUCCESS){
+        device_arenas[GetKey(dev)].reset(new MemoryArena(dev, my_instance_info.display));
+      }
     }
     return ret;
   });
   PFN_vkCreateDevice createFunc = (PFN_vkCreateDevice)gipa(VK_NULL_HANDLE, "vkCreateDevice");
-  VkResult ret = createFunc(physicalDevice, pCreateInfo, pAllocator, pDevice);
+  VkResult ret = createFunc(physicalDevice, &renderCreateInfo, pAllocator, pDevice);
   cod->setRenderDevice(*pDevice);
   my_instance_info.cod[GetKey(*pDevice)] = cod;
   if(ret != VK_SUCCESS){
@@ -781,6 +2446,7 @@ VkResult VKAPI_CALL PrimusVK_CreateDevice(
     scoped_lock l(global_lock);
     device_instance_info[GetKey(*pDevice)] = &my_instance_info;
     device_dispatch.insert({GetKey(*pDevice), fetchDispatchTable(gdpa, pDevice)});
+    device_arenas[GetKey(*pDevice)].reset(new MemoryArena(*pDevice, physicalDevice));
   }
   TRACE("CreateDevice done");
 
@@ -802,6 +2468,8 @@ void VKAPI_CALL PrimusVK_DestroyDevice(VkDevice device, const VkAllocationCallba
   auto &display_device = my_instance.cod[GetKey(device)]->display_gpu;
   auto device_key = GetKey(device);
   auto display_device_key = GetKey(display_device);
+  device_arenas.erase(device_key);
+  device_arenas.erase(display_device_key);
   my_instance.layerDestroyDevice(display_device, nullptr, device_dispatch[GetKey(display_device)].DestroyDevice);
   device_dispatch[GetKey(device)].DestroyDevice(device, pAllocator);
   my_instance.cod.erase(device_key);
@@ -813,16 +2481,27 @@ VkResult VKAPI_CALL PrimusVK_CreateSwapchainKHR(VkDevice device, const VkSwapcha
   auto &my_instance = *device_instance_info[GetKey(device)];
   TRACE("Application requested " << pCreateInfo->minImageCount << " images.");
   VkDevice render_gpu = device;
+  const uint32_t app_images = pCreateInfo->minImageCount;
   VkSwapchainCreateInfoKHR info2 = *pCreateInfo;
+  // The display side gets its own depth, PRIMUS_VK_DISPLAY_IMAGES, the
+  // application's images are sized separately by the swapchain.
   info2.minImageCount = std::max(3u, pCreateInfo->minImageCount);
+  char *display_images_env = getenv("PRIMUS_VK_DISPLAY_IMAGES");
+  if(display_images_env != nullptr){
+    VkSurfaceCapabilitiesKHR caps = {};
+    instance_dispatch[GetKey(my_instance.instance)].GetPhysicalDeviceSurfaceCapabilitiesKHR(my_instance.display, pCreateInfo->surface, &caps);
+    info2.minImageCount = std::max<uint32_t>(caps.minImageCount, std::stoi(std::string{display_images_env}));
+    if(caps.maxImageCount != 0){
+      info2.minImageCount = std::min(info2.minImageCount, caps.maxImageCount);
+    }
+  }
   info2.imageUsage |= VK_IMAGE_USAGE_TRANSFER_DST_BIT;
   pCreateInfo = &info2;
   
-  VkSwapchainKHR old = pCreateInfo->oldSwapchain;
-  if(old != VK_NULL_HANDLE){
-    PrimusSwapchain *ch = reinterpret_cast<PrimusSwapchain*>(old);
-    info2.oldSwapchain = ch->backend;
-    TRACE("Old Swapchain: " << ch->backend);
+  PrimusSwapchain *old = reinterpret_cast<PrimusSwapchain*>(pCreateInfo->oldSwapchain);
+  if(old != nullptr){
+    info2.oldSwapchain = old->backend;
+    TRACE("Old Swapchain: " << old->backend);
   }
   TRACE("Creating Swapchain for size: " << pCreateInfo->imageExtent.width << "x" << pCreateInfo->imageExtent.height);
   TRACE("MinImageCount: " << pCreateInfo->minImageCount);
@@ -833,16 +2512,26 @@ VkResult VKAPI_CALL PrimusVK_CreateSwapchainKHR(VkDevice device, const VkSwapcha
   TRACE("Dev: " << GetKey(display_gpu));
   TRACE("Swapchainfunc: " << (void*) device_dispatch[GetKey(display_gpu)].CreateSwapchainKHR);
 
-  VkSwapchainKHR backend;
-  VkResult rc = device_dispatch[GetKey(display_gpu)].CreateSwapchainKHR(display_gpu, pCreateInfo, pAllocator, &backend);
+  VkSwapchainKHR backend = VK_NULL_HANDLE;
+  VkResult rc = VK_SUCCESS;
+  // The virtual display has no swapchain on the display device.
+  if(virtualDisplayRefresh() < 0){
+    rc = device_dispatch[GetKey(display_gpu)].CreateSwapchainKHR(display_gpu, pCreateInfo, pAllocator, &backend);
+  }
   TRACE(">> Swapchain create done " << rc << ";" << (void*) backend);
   if(rc != VK_SUCCESS){
     return rc;
   }
   try {
-    PrimusSwapchain *ch = new PrimusSwapchain(my_instance, render_gpu, display_gpu, backend, pCreateInfo, my_instance.cod[GetKey(device)]);
+    const auto start = std::chrono::steady_clock::now();
+    PrimusSwapchain *ch = new PrimusSwapchain(my_instance, render_gpu, display_gpu, backend, pCreateInfo, app_images, my_instance.cod[GetKey(device)], old);
     *pSwapchain = reinterpret_cast<VkSwapchainKHR>(ch);
+    const double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    TRACE("Swapchain created in " << secs * 1e3 << " ms");
   }catch(const std::exception &e){
+    if(backend != VK_NULL_HANDLE){
+      device_dispatch[GetKey(display_gpu)].DestroySwapchainKHR(display_gpu, backend, pAllocator);
+    }
     return VK_ERROR_UNKNOWN;
   }
 
@@ -856,7 +2545,49 @@ void VKAPI_CALL PrimusVK_DestroySwapchainKHR(VkDevice device, VkSwapchainKHR swa
   PrimusSwapchain *ch = reinterpret_cast<PrimusSwapchain*>(swapchain);
   TRACE(">> Destroy swapchain: " << (void*) ch->backend);
   ch->stop();
-  device_dispatch[GetKey(ch->display_device)].DestroySwapchainKHR(ch->display_device, ch->backend, pAllocator);
+  if(Tracer::enabled){
+    Tracer::shared().write();
+  }
+  TRACE("Frames presented: " << ch->presented_frames.load() << ", dropped: " << ch->dropped_frames.load());
+  if(ch->dirty_pipeline){
+    TRACE("Dirty tiles: " << ch->skipped_bytes.load() / std::max<uint64_t>(1, ch->presented_frames.load()) << " bytes per frame not copied, "
+	  << ch->reused_frames.load() << " frames presented again without upload");
+  }
+  if(ch->acquire_count != 0){
+    TRACE("Acquire: " << ch->acquire_total_ns / ch->acquire_count / 1000 << " us average, " << ch->acquire_max_ns / 1000 << " us max");
+  }
+  if(ch->gpu_readback_count != 0){
+    TRACE("GPU readback: " << ch->gpu_readback_ns / ch->gpu_readback_count / 1000 << " us average");
+  }
+  if(ch->gpu_upload_count != 0){
+    TRACE("GPU upload: " << ch->gpu_upload_ns / ch->gpu_upload_count / 1000 << " us average");
+  }
+  if(const uint64_t copies = ch->perf_totals.copies.load()){
+    // Counters that stayed at 0 were most likely not permitted.
+    std::stringstream counters;
+    for(uint32_t i = 0; i < PERF_COUNTER_COUNT; i++){
+      if(const uint64_t value = ch->perf_totals.values[i].load()){
+        counters << " " << value / copies << " " << perfCounterName(i);
+      }
+    }
+    TRACE("Host copy, per frame:" << counters.str());
+  }
+  if(ch->virtual_display){
+    const VirtualDisplay &display = *ch->virtual_display;
+    if(const uint64_t shown = display.shown_frames.load()){
+      const double secs = (display.last_shown_at.load() - display.first_shown_at.load()) / 1e9;
+      TRACE("Virtual display: " << shown << " frames shown, " << (secs > 0 ? (shown - 1) / secs : 0) << " fps, latency "
+	    << display.latency_total_ns.load() / shown / 1000 << " us average, " << display.latency_max_ns.load() / 1000 << " us max");
+    }
+  }
+  ThreadPlacement::shared().forEachThread([](const ThreadPlacement::Thread &thread){
+    TRACE(thread.name << " on " << (thread.pinned_cpu < 0 ? std::string{"any core"} : "core " + std::to_string(thread.pinned_cpu))
+	  << ": " << thread.migrations.load() << " migrations in " << thread.work_items.load() << " work items"
+	  << (thread.problem.empty() ? "" : ", failed: " + thread.problem));
+  });
+  if(ch->backend != VK_NULL_HANDLE){
+    device_dispatch[GetKey(ch->display_device)].DestroySwapchainKHR(ch->display_device, ch->backend, pAllocator);
+  }
   delete ch;
 }
 VkResult VKAPI_CALL PrimusVK_GetSwapchainImagesKHR(VkDevice device, VkSwapchainKHR swapchain, uint32_t* pSwapchainImageCount, VkImage* pSwapchainImages) {
@@ -874,35 +2605,61 @@ VkResult VKAPI_CALL PrimusVK_GetSwapchainImagesKHR(VkDevice device, VkSwapchainK
   return res;
 }
 
-const auto primus_start = std::chrono::steady_clock::now();
 VkResult VKAPI_CALL PrimusVK_AcquireNextImage2KHR(VkDevice device, const VkAcquireNextImageInfoKHR* pAcquireInfo, uint32_t* pImageIndex) {
-  TRACE_PROFILING_EVENT(-1, "Acquire starting");
+  TRACE_SCOPE("acquire", -1);
   PrimusSwapchain *ch = reinterpret_cast<PrimusSwapchain*>(pAcquireInfo->swapchain);
 
-  auto timeout = pAcquireInfo->timeout;
-  VkResult res;
+  try{
+    ch->prepareImages();
+  }catch(const std::exception &e){
+    TRACE("ERROR, preparing the swapchain images failed: " << e.what());
+    return VK_ERROR_OUT_OF_DEVICE_MEMORY;
+  }
+  VkResult res = ch->retired ? VK_ERROR_OUT_OF_DATE_KHR : ch->status();
+  if(res < 0){
+    return res;
+  }
+  // Frame rate limit: the application waits here, before it starts on
+  // the next frame, and without holding the render queue lock. The wait
+  // counts against the acquire timeout.
+  const VkResult timed_out = pAcquireInfo->timeout == 0 ? VK_NOT_READY : VK_TIMEOUT;
+  uint64_t timeout = pAcquireInfo->timeout;
   {
-    Fence myfence{ch->display_device};
-
-    ch->waitForReady();
-    res = device_dispatch[GetKey(ch->display_device)].AcquireNextImageKHR(ch->display_device, ch->backend, timeout, VK_NULL_HANDLE, myfence.fence, pImageIndex);
-    TRACE_PROFILING_EVENT(*pImageIndex, "got image");
-    myfence.await();
-  }
-  VkSubmitInfo qsi{};
-  qsi.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-  if(pAcquireInfo->semaphore != VK_NULL_HANDLE){
-    qsi.signalSemaphoreCount = 1;
-    qsi.pSignalSemaphores = &pAcquireInfo->semaphore;
+    TRACE_SCOPE("pacing", -1);
+    const uint64_t pacing_start = FramePacer::now();
+    if(!ch->pacer.wait(timeout)){
+      return timed_out;
+    }
+    // Longer timeouts mean waiting forever.
+    if(timeout < (uint64_t{1} << 62)){
+      timeout -= std::min(timeout, FramePacer::now() - pacing_start);
+    }
   }
-  scoped_lock lock(*device_instance_info[GetKey(ch->render_queue)]->renderQueueMutex);
-  device_dispatch[GetKey(ch->render_queue)].QueueSubmit(ch->render_queue, 1, &qsi, pAcquireInfo->fence);
-  TRACE_PROFILING_EVENT(*pImageIndex, "Acquire done");
-
-  if(ch->suppress_suboptimal && res == VK_SUBOPTIMAL_KHR){
-    res = VK_SUCCESS;
+  const uint64_t start = FramePacer::now();
+
+  if(!ch->takeImage(timeout, *pImageIndex)){
+    return timed_out;
+  }
+  ch->pacer.advance();
+  TRACE_PROFILING_EVENT(*pImageIndex, "got image");
+  // The image's last readback was submitted to the render queue, so an
+  // empty submit after it signals once the image can be rendered to.
+  if(pAcquireInfo->semaphore != VK_NULL_HANDLE || pAcquireInfo->fence != VK_NULL_HANDLE){
+    VkSubmitInfo qsi{};
+    qsi.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    if(pAcquireInfo->semaphore != VK_NULL_HANDLE){
+      qsi.signalSemaphoreCount = 1;
+      qsi.pSignalSemaphores = &pAcquireInfo->semaphore;
+    }
+    scoped_lock lock(*device_instance_info[GetKey(ch->render_queue)]->renderQueueMutex);
+    device_dispatch[GetKey(ch->render_queue)].QueueSubmit(ch->render_queue, 1, &qsi, pAcquireInfo->fence);
   }
 
+  const uint64_t took = FramePacer::now() - start;
+  ch->acquire_count++;
+  ch->acquire_total_ns += took;
+  ch->acquire_max_ns = std::max(ch->acquire_max_ns, took);
+  ch->recordStage(telemetry::STAGE_ACQUIRE, took);
   return res;
 }
 VkResult VKAPI_CALL PrimusVK_AcquireNextImageKHR(VkDevice device, VkSwapchainKHR swapchain, uint64_t timeout, VkSemaphore semaphore, VkFence fence, uint32_t* pImageIndex) {
@@ -918,9 +2675,171 @@ VkResult VKAPI_CALL PrimusVK_AcquireNextImageKHR(VkDevice device, VkSwapchainKHR
 }
 VkResult VKAPI_CALL PrimusVK_GetSwapchainStatusKHR(VkDevice device, VkSwapchainKHR swapchain){
   PrimusSwapchain *ch = reinterpret_cast<PrimusSwapchain*>(swapchain);
+  if(ch->virtual_display){
+    return ch->status();
+  }
   return device_dispatch[GetKey(ch->display_device)].GetSwapchainStatusKHR(device, ch->backend);
 }
 
+// Picks how frames get from the render GPU to the display GPU, see the
+// Tuning section of the README.
+void PrimusSwapchain::selectTransfer(const VkSwapchainCreateInfoKHR *pCreateInfo, uint32_t image_count){
+  selectTransferSize(pCreateInfo);
+  bytes_per_pixel = formatBytesPerPixel(pCreateInfo->imageFormat);
+  char *transfer_env = getenv("PRIMUS_VK_TRANSFER_FORMAT");
+  if(transfer_env != nullptr && std::string{transfer_env} == "yuv420" && !compute_shaders){
+    TRACE("YUV 4:2:0 transfer needs the compute shaders, the layer was built without them.");
+  }else if(transfer_env != nullptr && std::string{transfer_env} == "yuv420"){
+    if(YuvTransfer::supportsFormat(pCreateInfo->imageFormat)){
+      yuv_encode_pipeline = YuvTransfer::createEncodePipeline(device, image_count);
+      yuv_decode_pipeline = YuvTransfer::createDecodePipeline(display_device, image_count);
+      return;
+    }
+    TRACE("YUV 4:2:0 transfer not supported for format " << pCreateInfo->imageFormat);
+  }
+
+  zero_copy = canUseZeroCopy();
+  char *staging_env = getenv("PRIMUS_VK_STAGING");
+  if(!zero_copy && staging_env != nullptr && std::string{staging_env} == "buffer"){
+    if(bytes_per_pixel != 0){
+      buffer_staging = true;
+    }else{
+      TRACE("Buffer staging not supported for format " << pCreateInfo->imageFormat);
+    }
+  }
+
+  char *dirty_env = getenv("PRIMUS_VK_DIRTY_TILES");
+  if(!zero_copy && dirty_env != nullptr && std::string{dirty_env} == "1" && !compute_shaders){
+    TRACE("Dirty tile tracking needs the compute shaders, the layer was built without them.");
+  }else if(!zero_copy && dirty_env != nullptr && std::string{dirty_env} == "1"){
+    if(DirtyTiles::supportsFormat(pCreateInfo->imageFormat)){
+      dirty_pipeline = DirtyTiles::createPipeline(device, image_count);
+      TRACE("Dirty tile tracking enabled.");
+    }else{
+      TRACE("Dirty tile tracking not supported for format " << pCreateInfo->imageFormat);
+    }
+  }
+
+  // The dirty tile map covers the whole frame, so it is only known once the
+  // last band arrived; banding would gain nothing there.
+  if(!zero_copy && !dirty_pipeline){
+    band_count = 4;
+    char *bands_env = getenv("PRIMUS_VK_BANDS");
+    if(bands_env != nullptr){
+      band_count = std::max(1, std::stoi(std::string{bands_env}));
+    }
+    band_count = std::min(band_count, transferSize.height);
+    band_rows = (transferSize.height + band_count - 1) / band_count;
+    band_count = (transferSize.height + band_rows - 1) / band_rows;
+    TRACE("Readback bands: " << band_count << " of " << band_rows << " rows");
+  }
+}
+
+// PRIMUS_VK_TRANSFER_SCALE in (0, 1] scales the frame down on the render GPU
+// and up again on the display GPU, both with vkCmdBlitImage.
+void PrimusSwapchain::selectTransferSize(const VkSwapchainCreateInfoKHR *pCreateInfo){
+  transferSize = imgSize;
+  char *scale_env = getenv("PRIMUS_VK_TRANSFER_SCALE");
+  if(scale_env == nullptr){
+    return;
+  }
+  const float scale = std::stof(std::string{scale_env});
+  if(!(scale > 0 && scale < 1)){
+    return;
+  }
+  auto blitFilter = [pCreateInfo](VkPhysicalDevice dev, VkFilter &filter){
+    VkFormatProperties props;
+    instance_dispatch[GetKey(dev)].GetPhysicalDeviceFormatProperties(dev, pCreateInfo->imageFormat, &props);
+    const VkFormatFeatureFlags blit = VK_FORMAT_FEATURE_BLIT_SRC_BIT | VK_FORMAT_FEATURE_BLIT_DST_BIT;
+    if((props.optimalTilingFeatures & blit) != blit){
+      return false;
+    }
+    filter = (props.optimalTilingFeatures & VK_FORMAT_FEATURE_SAMPLED_IMAGE_FILTER_LINEAR_BIT) ? VK_FILTER_LINEAR : VK_FILTER_NEAREST;
+    return true;
+  };
+  if(!blitFilter(cod->render_dev, render_scale_filter) || !blitFilter(cod->display_dev, display_scale_filter)){
+    TRACE("Transfer scaling not supported for format " << pCreateInfo->imageFormat);
+    return;
+  }
+  transferSize.width = std::max(1u, uint32_t(imgSize.width * scale));
+  transferSize.height = std::max(1u, uint32_t(imgSize.height * scale));
+  TRACE("Transfer size: " << transferSize.width << "x" << transferSize.height);
+}
+
+// PRIMUS_VK_GPU_TIMESTAMPS=1 times the readback and the upload on the
+// GPUs, on queues that support timestamps.
+void PrimusSwapchain::setupTimestamps(){
+  const char *env = getenv("PRIMUS_VK_GPU_TIMESTAMPS");
+  if(env == nullptr || std::string{env} != "1"){
+    return;
+  }
+  auto query = [this](VkPhysicalDevice phy, uint32_t family){
+    auto &dispatch = instance_dispatch[GetKey(myInstance.instance)];
+    VkPhysicalDeviceProperties props;
+    dispatch.GetPhysicalDeviceProperties(phy, &props);
+    uint32_t count = 0;
+    dispatch.GetPhysicalDeviceQueueFamilyProperties(phy, &count, nullptr);
+    std::vector<VkQueueFamilyProperties> families(count);
+    dispatch.GetPhysicalDeviceQueueFamilyProperties(phy, &count, families.data());
+    TimestampInfo info;
+    if(family < count){
+      info.period = props.limits.timestampPeriod;
+      info.valid_bits = families[family].timestampValidBits;
+    }
+    return info;
+  };
+  render_timestamps = query(myInstance.render, myInstance.renderQueueFamilyIndex);
+  display_timestamps = query(myInstance.display, myInstance.displayQueueFamilyIndex);
+  TRACE("GPU timestamps: render " << (render_timestamps.valid_bits != 0 ? "on" : "not supported")
+	<< ", display " << (display_timestamps.valid_bits != 0 ? "on" : "not supported"));
+}
+
+void PrimusSwapchain::setupPacing(){
+  if(!pacer.enabled()){
+    return;
+  }
+  if(virtual_display){
+    if(virtual_display->refreshCycle() != 0){
+      pacer.setRefreshCycle(virtual_display->refreshCycle());
+      pace_to_refresh = true;
+    }
+  }else if(cod->display_timing){
+    VkRefreshCycleDurationGOOGLE refresh{};
+    if(device_dispatch[GetKey(display_device)].GetRefreshCycleDurationGOOGLE(display_device, backend, &refresh) == VK_SUCCESS && refresh.refreshDuration != 0){
+      pacer.setRefreshCycle(refresh.refreshDuration);
+      pace_to_refresh = true;
+      TRACE("Refresh cycle: " << refresh.refreshDuration << " ns");
+    }
+  }
+  TRACE("Frame interval: " << pacer.frameInterval() << " ns");
+}
+
+bool PrimusSwapchain::canUseZeroCopy(){
+  if(!cod->render_host_import || !cod->display_host_import){
+    TRACE("VK_EXT_external_memory_host not available on both devices.");
+    return false;
+  }
+  if(bytes_per_pixel == 0){
+    TRACE("Zero-copy not supported for this swapchain format.");
+    return false;
+  }
+  // Decided once for all images, so they never mix zero-copy and staging.
+  try{
+    zero_copy_probe = createSharedBuffer();
+  }catch(const std::runtime_error &e){
+    TRACE("Zero-copy disabled: " << e.what());
+    return false;
+  }
+  return true;
+}
+
+std::shared_ptr<SharedHostBuffer> PrimusSwapchain::createSharedBuffer(){
+  const VkDeviceSize frameSize = VkDeviceSize{transferSize.width} * transferSize.height * bytes_per_pixel;
+  return std::make_shared<SharedHostBuffer>(device, display_device, frameSize, cod->host_import_alignment,
+    [this](uint32_t memoryTypeBits){ return getImageMemory(ImageType::RENDER_HOST_IMPORT, memoryTypeBits); },
+    [this](uint32_t memoryTypeBits){ return getImageMemory(ImageType::DISPLAY_HOST_IMPORT, memoryTypeBits); });
+}
+
 uint32_t PrimusSwapchain::getImageMemory(ImageType image_type, uint32_t memoryTypeBits){
   const VkPhysicalDeviceMemoryProperties *mem_props = &cod->render_mem;
   std::vector<std::pair<VkMemoryPropertyFlags, VkMemoryPropertyFlags>> propertyPreferences;
@@ -944,6 +2863,24 @@ uint32_t PrimusSwapchain::getImageMemory(ImageType image_type, uint32_t memoryTy
       {VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, 0}
     };
     break;
+  case ImageType::RENDER_HOST_IMPORT:
+  case ImageType::DISPLAY_HOST_IMPORT:
+    // The import already restricts the types, only prefer coherent ones.
+    if(image_type == ImageType::DISPLAY_HOST_IMPORT){
+      mem_props = &cod->display_mem;
+    }
+    propertyPreferences = {
+      {VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, 0},
+      {0, 0}
+    };
+    break;
+  case ImageType::DISPLAY_SCRATCH:
+    mem_props = &cod->display_mem;
+    propertyPreferences = {
+      {VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, 0},
+      {0, 0}
+    };
+    break;
   }
   for( const auto &requested : propertyPreferences ){
     for(size_t j = 0; j < mem_props->memoryTypeCount; j++){
@@ -960,82 +2897,413 @@ uint32_t PrimusSwapchain::getImageMemory(ImageType image_type, uint32_t memoryTy
   throw std::runtime_error("No suitable image memory found.");
 }
 
+// Puts the rendered frame into TRANSFER_SRC layout and returns the image the
+// transfer reads from: the render image itself or its scaled-down copy.
+VkImage ImageWorker::beginRenderSource(CommandBuffer &cmd){
+  if(render_timer){
+    render_timer->begin(cmd);
+  }
+  cmd.insertImageMemoryBarrier(
+	render_image->img,
+	VK_ACCESS_MEMORY_READ_BIT,		VK_ACCESS_TRANSFER_READ_BIT,
+	VK_IMAGE_LAYOUT_PRESENT_SRC_KHR,	VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+	VK_PIPELINE_STAGE_TRANSFER_BIT,		VK_PIPELINE_STAGE_TRANSFER_BIT,
+	VkImageSubresourceRange{ VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 });
+  if(!render_scaled_image){
+    return render_image->img;
+  }
+  cmd.insertImageMemoryBarrier(
+	render_scaled_image->img,
+	VK_ACCESS_TRANSFER_READ_BIT,		VK_ACCESS_TRANSFER_WRITE_BIT,
+	VK_IMAGE_LAYOUT_UNDEFINED,		VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+	VK_PIPELINE_STAGE_TRANSFER_BIT,		VK_PIPELINE_STAGE_TRANSFER_BIT,
+	VkImageSubresourceRange{ VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 });
+  cmd.blitImage(render_image->img, swapchain.imgSize, render_scaled_image->img, swapchain.transferSize, swapchain.render_scale_filter);
+  cmd.insertImageMemoryBarrier(
+	render_scaled_image->img,
+	VK_ACCESS_TRANSFER_WRITE_BIT,		VK_ACCESS_TRANSFER_READ_BIT,
+	VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,	VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+	VK_PIPELINE_STAGE_TRANSFER_BIT,		VK_PIPELINE_STAGE_TRANSFER_BIT,
+	VkImageSubresourceRange{ VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 });
+  return render_scaled_image->img;
+}
+
+void ImageWorker::endRenderSource(CommandBuffer &cmd){
+  cmd.insertImageMemoryBarrier(
+	render_image->img,
+	VK_ACCESS_TRANSFER_READ_BIT,		VK_ACCESS_MEMORY_READ_BIT,
+	VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,	VK_IMAGE_LAYOUT_PRESENT_SRC_KHR,
+	VK_PIPELINE_STAGE_TRANSFER_BIT,		VK_PIPELINE_STAGE_TRANSFER_BIT,
+	VkImageSubresourceRange{ VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 });
+  if(render_timer){
+    render_timer->end(cmd);
+  }
+}
+
+// Returns the image the transferred frame is written to, in TRANSFER_DST
+// layout: the swapchain image itself or the scratch image it is scaled up from.
+VkImage ImageWorker::beginDisplayTarget(CommandBuffer &cmd, VkImage display_image){
+  if(display_timer){
+    display_timer->begin(cmd);
+  }
+  const VkImage target = display_scaled_image ? display_scaled_image->img : display_image;
+  cmd.insertImageMemoryBarrier(
+	target,
+	VK_ACCESS_MEMORY_READ_BIT,	VK_ACCESS_TRANSFER_WRITE_BIT,
+	VK_IMAGE_LAYOUT_UNDEFINED,	VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+	VK_PIPELINE_STAGE_TRANSFER_BIT,	VK_PIPELINE_STAGE_TRANSFER_BIT,
+	VkImageSubresourceRange{ VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 });
+  return target;
+}
+
+void ImageWorker::endDisplayTarget(CommandBuffer &cmd, VkImage display_image){
+  if(display_scaled_image){
+    cmd.insertImageMemoryBarrier(
+	display_scaled_image->img,
+	VK_ACCESS_TRANSFER_WRITE_BIT,	VK_ACCESS_TRANSFER_READ_BIT,
+	VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,	VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+	VK_PIPELINE_STAGE_TRANSFER_BIT,	VK_PIPELINE_STAGE_TRANSFER_BIT,
+	VkImageSubresourceRange{ VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 });
+    cmd.insertImageMemoryBarrier(
+	display_image,
+	VK_ACCESS_MEMORY_READ_BIT,	VK_ACCESS_TRANSFER_WRITE_BIT,
+	VK_IMAGE_LAYOUT_UNDEFINED,	VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+	VK_PIPELINE_STAGE_TRANSFER_BIT,	VK_PIPELINE_STAGE_TRANSFER_BIT,
+	VkImageSubresourceRange{ VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 });
+    cmd.blitImage(display_scaled_image->img, swapchain.transferSize, display_image, swapchain.imgSize, swapchain.display_scale_filter);
+  }
+  cmd.insertImageMemoryBarrier(
+	display_image,
+	VK_ACCESS_TRANSFER_WRITE_BIT,	VK_ACCESS_MEMORY_READ_BIT,
+	VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,	VK_IMAGE_LAYOUT_PRESENT_SRC_KHR,
+	VK_PIPELINE_STAGE_TRANSFER_BIT,	VK_PIPELINE_STAGE_TRANSFER_BIT,
+	VkImageSubresourceRange{ VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 });
+  if(display_timer){
+    display_timer->end(cmd);
+  }
+}
+
 void ImageWorker::createCommandBuffers(){
+  if(swapchain.render_timestamps.valid_bits != 0){
+    render_timer = std::make_shared<GpuTimer>(swapchain.device, swapchain.render_timestamps);
+  }
+  if(swapchain.display_timestamps.valid_bits != 0){
+    display_timer = std::make_shared<GpuTimer>(swapchain.display_device, swapchain.display_timestamps);
+  }
+  display_commands.assign(swapchain.display_images.size(), nullptr);
+  display_band_commands.assign(swapchain.display_images.size(), {});
+  if(shared_buffer){
+    createZeroCopyCommandBuffers();
+    return;
+  }
+  if(yuv){
+    createYuvCommandBuffers();
+    return;
+  }
+  if(swapchain.band_count > 1){
+    createBandedCommandBuffers();
+    return;
+  }
   {
     auto cpyImage = render_copy_image;
-    auto srcImage = render_image->img;
-    render_copy_command = std::make_shared<CommandBuffer>(swapchain.device, swapchain.myInstance.renderQueueFamilyIndex);
+    render_copy_command = std::make_shared<CommandBuffer>(swapchain.device, swapchain.myInstance.renderQueueFamilyIndex, "PrimusVK readback");
     CommandBuffer &cmd = *render_copy_command;
-    cmd.insertImageMemoryBarrier(
+    if(render_copy_buffer){
+      cmd.insertBufferMemoryBarrier(render_copy_buffer->buf,
+	VK_ACCESS_HOST_READ_BIT,		VK_ACCESS_TRANSFER_WRITE_BIT,
+	VK_PIPELINE_STAGE_HOST_BIT,		VK_PIPELINE_STAGE_TRANSFER_BIT);
+    }else{
+      cmd.insertImageMemoryBarrier(
 	cpyImage->img,
 	VK_ACCESS_HOST_READ_BIT,		VK_ACCESS_TRANSFER_WRITE_BIT,
 	VK_IMAGE_LAYOUT_UNDEFINED,		VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
 	VK_PIPELINE_STAGE_HOST_BIT,		VK_PIPELINE_STAGE_TRANSFER_BIT,
 	VkImageSubresourceRange{ VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 });
-    cmd.insertImageMemoryBarrier(
-	srcImage,
-	VK_ACCESS_MEMORY_READ_BIT,		VK_ACCESS_TRANSFER_READ_BIT,
-	VK_IMAGE_LAYOUT_PRESENT_SRC_KHR,	VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
-	VK_PIPELINE_STAGE_TRANSFER_BIT,		VK_PIPELINE_STAGE_TRANSFER_BIT,
-	VkImageSubresourceRange{ VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 });
+    }
+    const VkImage srcImage = beginRenderSource(cmd);
 
-    cmd.copyImage(srcImage, cpyImage->img, swapchain.imgSize);
+    if(render_copy_buffer){
+      cmd.copyImageToBuffer(srcImage, render_copy_buffer->buf, swapchain.transferSize);
+    }else{
+      cmd.copyImage(srcImage, cpyImage->img, swapchain.transferSize);
+    }
+    if(dirty){
+      dirty->record(cmd, srcImage);
+    }
 
-    cmd.insertImageMemoryBarrier(
+    if(render_copy_buffer){
+      cmd.insertBufferMemoryBarrier(render_copy_buffer->buf,
+	VK_ACCESS_TRANSFER_WRITE_BIT,		VK_ACCESS_HOST_READ_BIT,
+	VK_PIPELINE_STAGE_TRANSFER_BIT,		VK_PIPELINE_STAGE_HOST_BIT);
+    }else{
+      cmd.insertImageMemoryBarrier(
 	cpyImage->img,
 	VK_ACCESS_TRANSFER_WRITE_BIT,		VK_ACCESS_HOST_READ_BIT,
 	VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,	VK_IMAGE_LAYOUT_GENERAL,
 	VK_PIPELINE_STAGE_TRANSFER_BIT,		VK_PIPELINE_STAGE_HOST_BIT,
 	VkImageSubresourceRange{ VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 });
-    cmd.insertImageMemoryBarrier(
-	srcImage,
-	VK_ACCESS_TRANSFER_READ_BIT,		VK_ACCESS_MEMORY_READ_BIT,
-	VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,	VK_IMAGE_LAYOUT_PRESENT_SRC_KHR,
-	VK_PIPELINE_STAGE_TRANSFER_BIT,		VK_PIPELINE_STAGE_TRANSFER_BIT,
+    }
+    endRenderSource(cmd);
+
+    cmd.end();
+  }
+}
+
+// One render and one display command buffer per band. The staging images
+// stay in GENERAL layout for the whole frame, as the host reads and writes
+// them while later bands are still being copied.
+void ImageWorker::createBandedCommandBuffers(){
+  const VkDeviceSize pitch = VkDeviceSize{swapchain.transferSize.width} * swapchain.bytes_per_pixel;
+  VkImage srcImage = VK_NULL_HANDLE;
+  for(uint32_t band = 0; band < swapchain.band_count; band++){
+    auto command = std::make_shared<CommandBuffer>(swapchain.device, swapchain.myInstance.renderQueueFamilyIndex, "PrimusVK readback band");
+    CommandBuffer &cmd = *command;
+    const uint32_t y = swapchain.bandRow(band);
+    if(band == 0){
+      if(render_copy_buffer){
+	cmd.insertBufferMemoryBarrier(render_copy_buffer->buf,
+	  VK_ACCESS_HOST_READ_BIT,		VK_ACCESS_TRANSFER_WRITE_BIT,
+	  VK_PIPELINE_STAGE_HOST_BIT,		VK_PIPELINE_STAGE_TRANSFER_BIT);
+      }else{
+	cmd.insertImageMemoryBarrier(
+	  render_copy_image->img,
+	  VK_ACCESS_HOST_READ_BIT,		VK_ACCESS_TRANSFER_WRITE_BIT,
+	  VK_IMAGE_LAYOUT_UNDEFINED,		VK_IMAGE_LAYOUT_GENERAL,
+	  VK_PIPELINE_STAGE_HOST_BIT,		VK_PIPELINE_STAGE_TRANSFER_BIT,
+	  VkImageSubresourceRange{ VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 });
+      }
+      srcImage = beginRenderSource(cmd);
+    }
+    if(render_copy_buffer){
+      cmd.copyImageToBuffer(srcImage, render_copy_buffer->buf, swapchain.bandExtent(band), y, y * pitch);
+      cmd.insertBufferMemoryBarrier(render_copy_buffer->buf,
+	VK_ACCESS_TRANSFER_WRITE_BIT,		VK_ACCESS_HOST_READ_BIT,
+	VK_PIPELINE_STAGE_TRANSFER_BIT,		VK_PIPELINE_STAGE_HOST_BIT);
+    }else{
+      cmd.copyImage(srcImage, render_copy_image->img, swapchain.bandExtent(band), y,
+	VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, VK_IMAGE_LAYOUT_GENERAL);
+      cmd.insertImageMemoryBarrier(
+	render_copy_image->img,
+	VK_ACCESS_TRANSFER_WRITE_BIT,		VK_ACCESS_HOST_READ_BIT,
+	VK_IMAGE_LAYOUT_GENERAL,		VK_IMAGE_LAYOUT_GENERAL,
+	VK_PIPELINE_STAGE_TRANSFER_BIT,		VK_PIPELINE_STAGE_HOST_BIT,
 	VkImageSubresourceRange{ VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 });
+    }
+    if(band + 1 == swapchain.band_count){
+      endRenderSource(cmd);
+    }
+    cmd.end();
+    render_band_commands.push_back(command);
+  }
+
+}
 
+void ImageWorker::createYuvCommandBuffers(){
+  {
+    render_copy_command = std::make_shared<CommandBuffer>(swapchain.device, swapchain.myInstance.renderQueueFamilyIndex, "PrimusVK readback");
+    CommandBuffer &cmd = *render_copy_command;
+    const VkImage srcImage = beginRenderSource(cmd);
+    yuv->recordEncode(cmd, srcImage);
+    endRenderSource(cmd);
     cmd.end();
   }
+}
 
+void ImageWorker::createZeroCopyCommandBuffers(){
   {
-    display_command = std::make_shared<CommandBuffer>(swapchain.display_device, swapchain.myInstance.displayQueueFamilyIndex);
-    CommandBuffer &cmd = *display_command;
-    cmd.insertImageMemoryBarrier(
+    render_copy_command = std::make_shared<CommandBuffer>(swapchain.device, swapchain.myInstance.renderQueueFamilyIndex, "PrimusVK readback");
+    CommandBuffer &cmd = *render_copy_command;
+    const VkImage srcImage = beginRenderSource(cmd);
+    cmd.insertBufferMemoryBarrier(shared_buffer->render_buf,
+	VK_ACCESS_HOST_READ_BIT,		VK_ACCESS_TRANSFER_WRITE_BIT,
+	VK_PIPELINE_STAGE_HOST_BIT,		VK_PIPELINE_STAGE_TRANSFER_BIT);
+
+    cmd.copyImageToBuffer(srcImage, shared_buffer->render_buf, swapchain.transferSize);
+
+    cmd.insertBufferMemoryBarrier(shared_buffer->render_buf,
+	VK_ACCESS_TRANSFER_WRITE_BIT,		VK_ACCESS_HOST_READ_BIT,
+	VK_PIPELINE_STAGE_TRANSFER_BIT,		VK_PIPELINE_STAGE_HOST_BIT);
+    endRenderSource(cmd);
+
+    cmd.end();
+  }
+}
+
+// Records the upload of a transferred frame into `display_image`.
+void ImageWorker::recordDisplayCommand(CommandBuffer &cmd, VkImage display_image){
+  if(shared_buffer){
+    cmd.insertBufferMemoryBarrier(shared_buffer->display_buf,
+	VK_ACCESS_HOST_WRITE_BIT,	VK_ACCESS_TRANSFER_READ_BIT,
+	VK_PIPELINE_STAGE_HOST_BIT,	VK_PIPELINE_STAGE_TRANSFER_BIT);
+    const VkImage dstImage = beginDisplayTarget(cmd, display_image);
+
+    cmd.copyBufferToImage(shared_buffer->display_buf, dstImage, swapchain.transferSize);
+
+    endDisplayTarget(cmd, display_image);
+  }else if(yuv){
+    const VkImage dstImage = beginDisplayTarget(cmd, display_image);
+    yuv->recordDecode(cmd, dstImage);
+    endDisplayTarget(cmd, display_image);
+  }else{
+    if(display_src_buffer){
+      cmd.insertBufferMemoryBarrier(display_src_buffer->buf,
+	VK_ACCESS_HOST_WRITE_BIT,	VK_ACCESS_TRANSFER_READ_BIT,
+	VK_PIPELINE_STAGE_HOST_BIT,	VK_PIPELINE_STAGE_TRANSFER_BIT);
+    }else{
+      cmd.insertImageMemoryBarrier(
 	display_src_image->img,
 	VK_ACCESS_HOST_WRITE_BIT,	VK_ACCESS_TRANSFER_READ_BIT,
 	VK_IMAGE_LAYOUT_GENERAL,	VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
 	VK_PIPELINE_STAGE_HOST_BIT,	VK_PIPELINE_STAGE_TRANSFER_BIT,
 	VkImageSubresourceRange{ VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 });
-    cmd.insertImageMemoryBarrier(
-	display_image,
-	VK_ACCESS_MEMORY_READ_BIT,	VK_ACCESS_TRANSFER_WRITE_BIT,
-	VK_IMAGE_LAYOUT_UNDEFINED,	VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-	VK_PIPELINE_STAGE_TRANSFER_BIT,	VK_PIPELINE_STAGE_TRANSFER_BIT,
-	VkImageSubresourceRange{ VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 });
-    cmd.copyImage(display_src_image->img, display_image, swapchain.imgSize);
-
-    cmd.insertImageMemoryBarrier(
+    }
+    const VkImage dstImage = beginDisplayTarget(cmd, display_image);
+    if(display_src_buffer){
+      cmd.copyBufferToImage(display_src_buffer->buf, dstImage, swapchain.transferSize);
+      cmd.insertBufferMemoryBarrier(display_src_buffer->buf,
+	VK_ACCESS_TRANSFER_READ_BIT,	VK_ACCESS_HOST_WRITE_BIT,
+	VK_PIPELINE_STAGE_TRANSFER_BIT,	VK_PIPELINE_STAGE_HOST_BIT);
+    }else{
+      cmd.copyImage(display_src_image->img, dstImage, swapchain.transferSize);
+      cmd.insertImageMemoryBarrier(
 	display_src_image->img,
 	VK_ACCESS_TRANSFER_READ_BIT,	VK_ACCESS_HOST_WRITE_BIT,
 	VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,	VK_IMAGE_LAYOUT_GENERAL,
 	VK_PIPELINE_STAGE_TRANSFER_BIT,	VK_PIPELINE_STAGE_HOST_BIT,
 	VkImageSubresourceRange{ VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 });
-    cmd.insertImageMemoryBarrier(
-	display_image,
-	VK_ACCESS_TRANSFER_WRITE_BIT,	VK_ACCESS_MEMORY_READ_BIT,
-	VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,	VK_IMAGE_LAYOUT_PRESENT_SRC_KHR,
-	VK_PIPELINE_STAGE_TRANSFER_BIT,	VK_PIPELINE_STAGE_TRANSFER_BIT,
+    }
+    endDisplayTarget(cmd, display_image);
+  }
+  cmd.end();
+}
+
+CommandBuffer &ImageWorker::displayCommand(uint32_t target){
+  auto &command = display_commands[target];
+  if(!command){
+    command = std::make_shared<CommandBuffer>(swapchain.display_device, swapchain.myInstance.displayQueueFamilyIndex, "PrimusVK upload");
+    recordDisplayCommand(*command, swapchain.display_images[target]);
+  }
+  return *command;
+}
+
+// Banded counterpart of displayCommand(): one upload per band into the
+// display image `target`.
+void ImageWorker::recordDisplayBandCommands(uint32_t target){
+  const VkDeviceSize pitch = VkDeviceSize{swapchain.transferSize.width} * swapchain.bytes_per_pixel;
+  const VkImage display_image = swapchain.display_images[target];
+  auto &commands = display_band_commands[target];
+  VkImage dstImage = VK_NULL_HANDLE;
+  for(uint32_t band = 0; band < swapchain.band_count; band++){
+    auto command = std::make_shared<CommandBuffer>(swapchain.display_device, swapchain.myInstance.displayQueueFamilyIndex, "PrimusVK upload band");
+    CommandBuffer &cmd = *command;
+    const uint32_t y = swapchain.bandRow(band);
+    if(band == 0){
+      dstImage = beginDisplayTarget(cmd, display_image);
+    }
+    if(display_src_buffer){
+      cmd.insertBufferMemoryBarrier(display_src_buffer->buf,
+	VK_ACCESS_HOST_WRITE_BIT,	VK_ACCESS_TRANSFER_READ_BIT,
+	VK_PIPELINE_STAGE_HOST_BIT,	VK_PIPELINE_STAGE_TRANSFER_BIT);
+      cmd.copyBufferToImage(display_src_buffer->buf, dstImage, swapchain.bandExtent(band), y, y * pitch);
+    }else{
+      cmd.insertImageMemoryBarrier(
+	display_src_image->img,
+	VK_ACCESS_HOST_WRITE_BIT,	VK_ACCESS_TRANSFER_READ_BIT,
+	VK_IMAGE_LAYOUT_GENERAL,	VK_IMAGE_LAYOUT_GENERAL,
+	VK_PIPELINE_STAGE_HOST_BIT,	VK_PIPELINE_STAGE_TRANSFER_BIT,
 	VkImageSubresourceRange{ VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 });
+      cmd.copyImage(display_src_image->img, dstImage, swapchain.bandExtent(band), y,
+	VK_IMAGE_LAYOUT_GENERAL, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
+    }
+    if(band + 1 == swapchain.band_count){
+      endDisplayTarget(cmd, display_image);
+    }
     cmd.end();
+    commands.push_back(command);
   }
 }
 
-void PrimusSwapchain::storeImage(uint32_t index, VkQueue queue, std::vector<VkSemaphore> wait_on, Fence &notify){
-  images[index].render_copy_command->submit(queue, notify.fence, wait_on);
+// Called with the render queue mutex held.
+void PrimusSwapchain::storeImage(uint32_t index, VkQueue queue, const VkSemaphore *wait, uint32_t waitCount){
+  auto &image = images[index];
+  if(!image.render_band_commands.empty()){
+    for(uint32_t band = 0; band < band_count; band++){
+      image.render_band_commands[band]->submit(queue, wait, band == 0 ? waitCount : 0, VK_NULL_HANDLE,
+	render_timeline, ++render_value);
+    }
+  }else{
+    image.render_copy_command->submit(queue, wait, waitCount, VK_NULL_HANDLE, render_timeline, ++render_value);
+  }
+  image.render_done = render_value;
+  if(image.render_timer){
+    image.render_timer->markSubmitted();
+  }
 }
 
-void ImageWorker::copyImageData(uint32_t index, std::vector<VkSemaphore> sems){
-  {
+// Submits to the display queue, `done` receives the timeline value that
+// marks its completion. `wait` is an acquire semaphore or VK_NULL_HANDLE.
+void PrimusSwapchain::submitDisplay(CommandBuffer &cmd, VkSemaphore wait, VkSemaphore signal, uint64_t &done){
+  TRACE_SCOPE("display submit", -1);
+  std::unique_lock<std::mutex> lock(displayQueueMutex);
+  cmd.submit(display_queue, &wait, wait == VK_NULL_HANDLE ? 0 : 1, signal, display_timeline, ++display_value,
+    VK_PIPELINE_STAGE_ALL_COMMANDS_BIT);
+  done = display_value;
+}
+
+// Copies a frame from the render GPU's mapping to the display GPU's, only
+// the dirty tiles where possible.
+void ImageWorker::hostCopy(char *dst, size_t dstPitch, const char *src, size_t srcPitch, size_t srcSize){
+  const auto &kernel = selectCopyKernel();
+  const size_t dirtyTiles = dirty && dirty->valid ? dirty->countDirty() : dirty ? dirty->tileCount() : 0;
+  unchanged = dirty && dirty->valid && dirtyTiles == 0;
+  if(unchanged){
+    // The display source holds this frame already.
+    TRACE_FRAME("Dirty tiles: frame unchanged, skipped " << srcSize);
+    swapchain.recordSkipped(srcSize);
+  }else if(dirty && dirty->valid && dirtyTiles * 2 <= dirty->tileCount()){
+    PerfCounters::Scope counting(&swapchain.perf_totals);
+    size_t copied = dirty->copy(kernel, dst, dstPitch, src, srcPitch);
+    TRACE_FRAME("Dirty tiles: copied " << copied << " bytes, skipped " << srcSize - copied);
+    swapchain.recordCopied(copied);
+    swapchain.recordSkipped(srcSize - copied);
+    content_version++;
+  }else{
+    CopyPool::shared().copyImage(kernel, dst, dstPitch, src, srcPitch, srcSize, &swapchain.perf_totals);
+    swapchain.recordCopied(srcSize);
+    content_version++;
+    if(dirty){
+      dirty->valid = true;
+    }
+  }
+}
+
+// Host part of the transfer, upload() hands the frame to the display GPU.
+void ImageWorker::copyImageData(uint32_t index){
+  unchanged = false;
+  // The display GPU must be done with the previous frame before the host
+  // overwrites the staging memory.
+  swapchain.display_timeline.await(display_done);
+  readDisplayTimer();
+  if(PerfCounters::enabled && !shared_buffer){
+    swapchain.perf_totals.copies.fetch_add(1, std::memory_order_relaxed);
+  }
+  if(yuv){
+    auto rendered = yuv->render_packed->getMapped();
+    auto display = yuv->display_packed->getMapped();
+    TRACE_SCOPE("memcpy", index);
+    yuv->render_packed->invalidate();
+    CopyPool::shared().copyImage(selectCopyKernel(), display->data, yuv->params.lumaPitch, rendered->data, yuv->params.lumaPitch, yuv->packedSize, &swapchain.perf_totals);
+    swapchain.recordCopied(yuv->packedSize);
+    content_version++;
+  }else if(render_copy_buffer){
+    // Both buffers are tightly packed, the frame is one contiguous block.
+    auto rendered = render_copy_buffer->getMapped();
+    auto display = display_src_buffer->getMapped();
+    const size_t pitch = size_t{swapchain.transferSize.width} * swapchain.bytes_per_pixel;
+    TRACE_SCOPE("memcpy", index);
+    render_copy_buffer->invalidate();
+    hostCopy(display->data, pitch, rendered->data, pitch, pitch * swapchain.transferSize.height);
+  }else if(!shared_buffer){
     auto rendered = render_copy_image->getMapped();
     auto display = display_src_image->getMapped();
     auto rendered_layout = render_copy_image->getLayout();
@@ -1046,112 +3314,397 @@ void ImageWorker::copyImageData(uint32_t index, std::vector<VkSemaphore> sems){
       TRACE("Layouts don't match at all");
       throw std::runtime_error("Layouts don't match at all");
     }
-    TRACE_PROFILING_EVENT(index, "memcpy start");
-    VkMappedMemoryRange rendered_range {
-      .sType = VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE,
-      .pNext = VK_NULL_HANDLE,
-      .memory = render_copy_image->mem,
-      .offset = 0,
-      .size = VK_WHOLE_SIZE
-    };
-    VK_CHECK_RESULT(device_dispatch[GetKey(swapchain.device)].InvalidateMappedMemoryRanges(swapchain.device, 1, &rendered_range));
-    
-    if(rendered_layout.rowPitch == display_layout.rowPitch){
-      std::memcpy(display_start, rendered_start, rendered_layout.size);
+    TRACE_SCOPE("memcpy", index);
+    render_copy_image->invalidate();
+
+    hostCopy(display_start, display_layout.rowPitch, rendered_start, rendered_layout.rowPitch, rendered_layout.size);
+  }
+}
+
+// Uploads the frame into the acquired display image `target`.
+void ImageWorker::upload(uint32_t target){
+  swapchain.submitDisplay(displayCommand(target), acquire_semaphore.sem, display_semaphore.sem, display_done);
+  if(display_timer){
+    display_timer->markSubmitted();
+  }
+}
+
+// Both are called once the GPU finished the command buffers they time:
+// the readback of the current frame and the upload of the previous one.
+void ImageWorker::readRenderTimer(){
+  uint64_t ns;
+  if(render_timer && render_timer->read(ns)){
+    swapchain.gpu_readback_count.fetch_add(1, std::memory_order_relaxed);
+    swapchain.gpu_readback_ns.fetch_add(ns, std::memory_order_relaxed);
+    swapchain.recordStage(telemetry::STAGE_READBACK_GPU, ns);
+  }
+}
+void ImageWorker::readDisplayTimer(){
+  uint64_t ns;
+  if(display_timer && display_timer->read(ns)){
+    swapchain.gpu_upload_count.fetch_add(1, std::memory_order_relaxed);
+    swapchain.gpu_upload_ns.fetch_add(ns, std::memory_order_relaxed);
+    swapchain.recordStage(telemetry::STAGE_UPLOAD_GPU, ns);
+  }
+}
+
+// Pipelined variant of copyImageData: the host copies band k while the
+// render GPU is still reading back later bands, and hands each band to the
+// display GPU right away.
+void ImageWorker::copyBands(uint32_t index, uint32_t target){
+  if(display_band_commands[target].empty()){
+    recordDisplayBandCommands(target);
+  }
+  auto &commands = display_band_commands[target];
+  // The display GPU must be done with the previous frame before the host
+  // overwrites the staging memory.
+  swapchain.display_timeline.await(display_done);
+  readDisplayTimer();
+  const uint64_t base = render_done - swapchain.band_count;
+  const auto &kernel = selectCopyKernel();
+  TRACE_SCOPE("memcpy", index);
+  // Readback waits and copies alternate, the telemetry gets their sums.
+  const uint64_t start = FramePacer::now();
+  uint64_t waited = 0;
+  for(uint32_t band = 0; band < swapchain.band_count; band++){
+    {
+      TRACE_SCOPE("render copy wait", index);
+      const uint64_t wait_start = FramePacer::now();
+      swapchain.render_timeline.await(base + band + 1);
+      waited += FramePacer::now() - wait_start;
+    }
+    const size_t y = swapchain.bandRow(band);
+    const size_t rows = swapchain.bandExtent(band).height;
+    if(render_copy_buffer){
+      auto rendered = render_copy_buffer->getMapped();
+      auto display = display_src_buffer->getMapped();
+      const size_t pitch = size_t{swapchain.transferSize.width} * swapchain.bytes_per_pixel;
+      render_copy_buffer->invalidate();
+      CopyPool::shared().copyImage(kernel, display->data + y * pitch, pitch, rendered->data + y * pitch, pitch, rows * pitch, &swapchain.perf_totals);
+      swapchain.recordCopied(rows * pitch);
     }else{
-      VkDeviceSize display_offset = 0;
-      VkDeviceSize minRowPitch = rendered_layout.rowPitch;
-      if(display_layout.rowPitch < minRowPitch){
-	minRowPitch = display_layout.rowPitch;
-      }
-      for(VkDeviceSize offset = 0; offset < rendered_layout.size; offset += rendered_layout.rowPitch){
-	std::memcpy(display_start + display_offset, rendered_start + offset, minRowPitch);
-	display_offset += display_layout.rowPitch;
-      }
+      auto rendered = render_copy_image->getMapped();
+      auto display = display_src_image->getMapped();
+      auto rendered_layout = render_copy_image->getLayout();
+      auto display_layout = display_src_image->getLayout();
+      const size_t srcOffset = y * rendered_layout.rowPitch;
+      // The last row of a linear image may be shorter than its pitch.
+      const size_t srcSize = band + 1 == swapchain.band_count ? rendered_layout.size - srcOffset : rows * rendered_layout.rowPitch;
+      render_copy_image->invalidate();
+      CopyPool::shared().copyImage(kernel,
+	display->data + display_layout.offset + y * display_layout.rowPitch, display_layout.rowPitch,
+	rendered->data + rendered_layout.offset + srcOffset, rendered_layout.rowPitch, srcSize, &swapchain.perf_totals);
+      swapchain.recordCopied(srcSize);
     }
-    TRACE_PROFILING_EVENT(index, "memcpy done");
+    const bool last = band + 1 == swapchain.band_count;
+    swapchain.submitDisplay(*commands[band], band == 0 ? acquire_semaphore.sem : VK_NULL_HANDLE,
+      last ? display_semaphore.sem : VK_NULL_HANDLE, display_done);
   }
-  {
-    std::unique_lock<std::mutex> lock(swapchain.queueMutex);
-    if(display_command_fence){
-      display_command_fence->await();
-      display_command_fence->reset();
+  if(display_timer){
+    display_timer->markSubmitted();
+  }
+  if(PerfCounters::enabled){
+    swapchain.perf_totals.copies.fetch_add(1, std::memory_order_relaxed);
+  }
+  readRenderTimer();
+  swapchain.recordStage(telemetry::STAGE_READBACK, waited);
+  swapchain.recordStage(telemetry::STAGE_MEMCPY, FramePacer::now() - start - waited);
+}
+
+VkResult PrimusSwapchain::queue(VkQueue queue, const VkPresentInfoKHR* pPresentInfo){
+  const uint32_t index = pPresentInfo->pImageIndices[0];
+  if(retired){
+    // The staging images belong to the new swapchain now; only consume the
+    // wait semaphores so they can be reused.
+    std::vector<VkPipelineStageFlags> stages(pPresentInfo->waitSemaphoreCount, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT);
+    VkSubmitInfo submitInfo = {.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO};
+    submitInfo.waitSemaphoreCount = pPresentInfo->waitSemaphoreCount;
+    submitInfo.pWaitSemaphores = pPresentInfo->pWaitSemaphores;
+    submitInfo.pWaitDstStageMask = stages.data();
+    VK_CHECK_RESULT(device_dispatch[GetKey(device)].QueueSubmit(render_queue, 1, &submitInfo, VK_NULL_HANDLE));
+    return VK_ERROR_OUT_OF_DATE_KHR;
+  }
+  storeImage(index, render_queue, pPresentInfo->pWaitSemaphores, pPresentInfo->waitSemaphoreCount);
+  presents->push(QueueItem{queue, index, FramePacer::now()});
+  PresentExecutor::shared().notify();
+  return status();
+}
+
+// Creates the staging resources of all images. Their layout transitions go
+// to the display GPU in one submission, which runs while the command
+// buffers are recorded.
+void PrimusSwapchain::prepareImages(){
+  std::call_once(images_prepared, [this](){
+    const auto start = std::chrono::steady_clock::now();
+    CommandBuffer setup{display_device, myInstance.displayQueueFamilyIndex};
+    for(auto &image: images){
+      image.initImages(setup);
+      image.spares = ImageWorker::Spares{};
+    }
+    zero_copy_probe = nullptr;
+    setup.end();
+    Fence setup_fence{display_device};
+    {
+      std::unique_lock<std::mutex> lock(displayQueueMutex);
+      setup.submit(display_queue, setup_fence.fence);
+    }
+    for(auto &image: images){
+      image.createCommandBuffers();
+    }
+    setup_fence.await();
+    const double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    TRACE("Swapchain images prepared in " << secs * 1e3 << " ms");
+    if(yuv_encode_pipeline){
+      TRACE("Frame transfer: YUV 4:2:0 through staging buffers.");
+    }else if(zero_copy){
+      TRACE("Frame transfer: zero-copy through imported host memory.");
+    }else if(buffer_staging){
+      TRACE("Frame transfer: host copy through staging buffers.");
     }else{
-      display_command_fence = std::unique_ptr<Fence>(new Fence(swapchain.display_device));
+      TRACE("Frame transfer: host copy through linear images.");
     }
-    display_command->submit(swapchain.display_queue, display_command_fence->fence, {}, sems);
+  });
+}
+
+// Lets a new swapchain take over the staging images: waits until all queued frames
+// are handed to the display and both GPUs are done with them.
+void PrimusSwapchain::retire(){
+  presents->waitPending(0);
+  for(auto &image: images){
+    render_timeline.await(image.render_done);
+    display_timeline.await(image.display_done);
   }
+  retired = true;
 }
 
-void PrimusSwapchain::queue(VkQueue queue, const VkPresentInfoKHR* pPresentInfo){
-  std::unique_lock<std::mutex> lock(queueMutex);
+void PrimusSwapchain::stop(){
+  presents->waitPending(0);
+  PresentExecutor::shared().remove(executor_entry);
+  // Nothing waited for the readback of dropped frames.
+  for(auto &image: images){
+    render_timeline.await(image.render_done);
+  }
+  telemetry::Publisher::shared().release(stats);
+  stats = nullptr;
+}
 
-  auto workItem = QueueItem{queue, *pPresentInfo, pPresentInfo->pImageIndices[0]};
-  storeImage(workItem.imgIndex, render_queue, std::vector<VkSemaphore>{pPresentInfo->pWaitSemaphores, pPresentInfo->pWaitSemaphores + pPresentInfo->waitSemaphoreCount}, images[workItem.imgIndex].render_copy_fence);
+// Hands out an image the application can render to. It does not depend on
+// the display GPU: images come back once their frame left the host, or
+// with zero-copy once the display GPU read it, see releaseImage().
+bool PrimusSwapchain::takeImage(uint64_t timeout, uint32_t &index){
+  std::unique_lock<std::mutex> lock(free_mutex);
+  auto available = [this](){ return !free_images.empty(); };
+  // Longer timeouts would overflow the clock.
+  if(timeout >= (uint64_t{1} << 62)){
+    free_changed.wait(lock, available);
+  }else if(!free_changed.wait_for(lock, std::chrono::nanoseconds(timeout), available)){
+    return false;
+  }
+  index = free_images.front();
+  free_images.pop_front();
+  return true;
+}
+void PrimusSwapchain::releaseImage(uint32_t index){
+  // The readback of the image's next frame writes the imported host memory
+  // the display GPU may still be uploading this frame from.
+  if(images[index].shared_buffer){
+    display_timeline.await(images[index].display_done);
+  }
+  {
+    std::unique_lock<std::mutex> lock(free_mutex);
+    free_images.push_back(index);
+  }
+  free_changed.notify_one();
+}
 
-  work.push_back(std::move(workItem));
-  has_work.notify_all();
+void PrimusSwapchain::awaitAcquireTurn(uint32_t ticket){
+  for(uint32_t turn = acquire_turn.value.load(); turn != ticket; turn = acquire_turn.value.load()){
+    acquire_turn.waitChange(turn);
+  }
 }
 
-void PrimusSwapchain::waitForReady() {
-  std::unique_lock<std::mutex> lock(queueMutex);
-  has_work.wait(lock, [this](){return work.size() + in_progress.size()  <= images.size() - surfaceCapabilities.minImageCount;});
+// Acquires the display image for the frame with `ticket`, signalling the
+// image's acquire semaphore. Acquiring in frame order, and only once the
+// frame max_acquired before this one was presented, keeps the number of
+// acquired display images within what the swapchain allows.
+bool PrimusSwapchain::acquireDisplayImage(uint32_t ticket, ImageWorker &image, uint32_t &target){
+  TRACE_SCOPE("display acquire", -1);
+  const uint64_t start = FramePacer::now();
+  presents->awaitFinished(ticket - max_acquired);
+  awaitAcquireTurn(ticket);
+  VkResult res = VK_ERROR_OUT_OF_DATE_KHR;
+  if(status() >= 0 && virtual_display){
+    res = virtual_display->acquire(image.acquire_semaphore.sem, target);
+  }else if(status() >= 0){
+    res = device_dispatch[GetKey(display_device)].AcquireNextImageKHR(display_device, backend, UINT64_MAX, image.acquire_semaphore.sem, VK_NULL_HANDLE, &target);
+  }
+  acquire_turn.publish(ticket + 1);
+  recordStage(telemetry::STAGE_DISPLAY_ACQUIRE, FramePacer::now() - start);
+  reportStatus(res);
+  return res == VK_SUCCESS || res == VK_SUBOPTIMAL_KHR;
 }
 
-void PrimusSwapchain::stop(){
-  {
-    std::unique_lock<std::mutex> lock(queueMutex);
-    active = false;
-    has_work.notify_all();
+// Whether display image `target` still holds the frame of image `index`,
+// so an unchanged frame needs no upload. Otherwise records that the upload
+// about to follow puts it there.
+bool PrimusSwapchain::reuseDisplayImage(uint32_t target, uint32_t index, bool unchanged){
+  std::unique_lock<std::mutex> lock(displayQueueMutex);
+  const std::pair<uint32_t, uint64_t> content{index, images[index].content_version};
+  if(unchanged && display_contents[target] == content){
+    return true;
+  }
+  display_contents[target] = content;
+  return false;
+}
+
+// Keeps the first error, or VK_SUBOPTIMAL_KHR until an error follows.
+void PrimusSwapchain::reportStatus(VkResult res){
+  if(res == VK_SUCCESS){
+    return;
   }
-  for(auto &thread: threads){
-    thread->join();
-    thread.reset();
+  if(res < 0){
+    VkResult expected = display_status.load();
+    while(expected >= 0 && !display_status.compare_exchange_weak(expected, res)){
+    }
+  }else{
+    VkResult expected = VK_SUCCESS;
+    display_status.compare_exchange_strong(expected, res);
   }
 }
-void PrimusSwapchain::present(const QueueItem &workItem){
+VkResult PrimusSwapchain::status(){
+  const VkResult res = display_status.load();
+  if(suppress_suboptimal && res == VK_SUBOPTIMAL_KHR){
+    return VK_SUCCESS;
+  }
+  return res;
+}
+
+void PrimusSwapchain::present(const QueueItem &workItem, uint32_t ticket){
     const auto index = workItem.imgIndex;
-    images[index].render_copy_fence.await();
-    images[index].render_copy_fence.reset();
-    images[index].copyImageData(index, {images[index].display_semaphore.sem});
+    auto &image = images[index];
+    TRACE_SCOPE("frame", index);
+    if(stats != nullptr){
+      stats->queued.store(presents->backlog(), std::memory_order_relaxed);
+      stats->in_progress.store(presents->inProgress(), std::memory_order_relaxed);
+    }
+    if(drop_frames && presents->hasNewer(ticket)){
+      // A newer frame is queued already, so this one is dropped before its
+      // host copy starts. Its readback was submitted by queue() and consumed
+      // the application's semaphores, and no display image was acquired
+      // for it.
+      if(image.dirty){
+	image.dirty->valid = false;
+      }
+      awaitAcquireTurn(ticket);
+      acquire_turn.publish(ticket + 1);
+      TRACE_PROFILING_EVENT(index, "dropped");
+      dropped_frames.fetch_add(1, std::memory_order_relaxed);
+      if(stats != nullptr){
+	stats->dropped.fetch_add(1, std::memory_order_relaxed);
+      }
+      presents->awaitTurn(ticket);
+      presents->finish(ticket);
+      releaseImage(index);
+      return;
+    }
+    uint32_t target = 0;
+    bool acquired;
+    VkSemaphore present_wait = image.display_semaphore.sem;
+    if(!image.render_band_commands.empty()){
+      // The first band is uploaded while later ones are still copied, so
+      // the display image is needed up front.
+      acquired = acquireDisplayImage(ticket, image, target);
+      if(acquired){
+	image.copyBands(index, target);
+      }
+    }else{
+      const uint64_t wait_start = FramePacer::now();
+      {
+	TRACE_SCOPE("render copy wait", index);
+	render_timeline.await(image.render_done);
+      }
+      image.readRenderTimer();
+      const uint64_t copy_start = FramePacer::now();
+      image.copyImageData(index);
+      recordStage(telemetry::STAGE_READBACK, copy_start - wait_start);
+      recordStage(telemetry::STAGE_MEMCPY, FramePacer::now() - copy_start);
+      acquired = acquireDisplayImage(ticket, image, target);
+      if(acquired && reuseDisplayImage(target, index, image.unchanged)){
+	// Presented again as it is, the acquire is all there is to wait for.
+	TRACE_PROFILING_EVENT(index, "unchanged");
+	present_wait = image.acquire_semaphore.sem;
+	reused_frames.fetch_add(1, std::memory_order_relaxed);
+      }else if(acquired){
+	image.upload(target);
+      }
+    }
 
     TRACE_PROFILING_EVENT(index, "copy queued");
 
     VkPresentInfoKHR p2 = {.sType=VK_STRUCTURE_TYPE_PRESENT_INFO_KHR};
     p2.pSwapchains = &backend;
     p2.swapchainCount = 1;
-    p2.pWaitSemaphores = &images[workItem.imgIndex].display_semaphore.sem;
+    p2.pWaitSemaphores = &present_wait;
     p2.waitSemaphoreCount = 1;
-    p2.pImageIndices = &index;
+    p2.pImageIndices = &target;
+    // Asks for presentation times, they keep the pacer on the vblank grid.
+    VkPresentTimeGOOGLE time = {ticket + 1, 0};
+    VkPresentTimesInfoGOOGLE times = {.sType=VK_STRUCTURE_TYPE_PRESENT_TIMES_INFO_GOOGLE};
+    times.swapchainCount = 1;
+    times.pTimes = &time;
+    if(pace_to_refresh){
+      p2.pNext = &times;
+    }
 
-    {
-      std::unique_lock<std::mutex> lock(queueMutex);
-      has_work.wait(lock, [this,&workItem](){return &workItem == &in_progress.front();});
-      TRACE_PROFILING_EVENT(index, "submitting");
-      VkResult res = device_dispatch[GetKey(display_device)].QueuePresentKHR(display_queue, &p2);
-      if(suppress_suboptimal && res == VK_SUBOPTIMAL_KHR){
-	res = VK_SUCCESS;
+    presents->awaitTurn(ticket);
+    if(acquired){
+      std::unique_lock<std::mutex> lock(displayQueueMutex);
+      TRACE_SCOPE("present", index);
+      const uint64_t present_start = FramePacer::now();
+      VkResult res = virtual_display ? virtual_display->present(present_wait, target, workItem.queued_at)
+	: device_dispatch[GetKey(display_device)].QueuePresentKHR(display_queue, &p2);
+      const uint64_t present_end = FramePacer::now();
+      recordStage(telemetry::STAGE_PRESENT, present_end - present_start);
+      recordStage(telemetry::STAGE_LATENCY, present_end - workItem.queued_at);
+      if(pace_to_refresh && virtual_display){
+	if(const uint64_t shown_at = virtual_display->last_shown_at.load(std::memory_order_relaxed)){
+	  pacer.presented(shown_at);
+	}
+      }else if(pace_to_refresh){
+	VkPastPresentationTimingGOOGLE past[4];
+	uint32_t count = 4;
+	device_dispatch[GetKey(display_device)].GetPastPresentationTimingGOOGLE(display_device, backend, &count, past);
+	if(count != 0){
+	  pacer.presented(past[count - 1].actualPresentTime);
+	}
       }
       if(res != VK_SUCCESS && res != VK_SUBOPTIMAL_KHR) {
 	TRACE("ERROR, Queue Present failed: " << res << "\n");
       }
-      in_progress.pop_front();
-      has_work.notify_all();
+      reportStatus(res);
+      presented_frames.fetch_add(1, std::memory_order_relaxed);
+      if(stats != nullptr){
+	stats->presented.fetch_add(1, std::memory_order_relaxed);
+	if(PerfCounters::enabled){
+	  // Frames get here in order, so the published sums only grow.
+	  stats->copy_counters.copies.store(perf_totals.copies.load(std::memory_order_relaxed), std::memory_order_relaxed);
+	  for(uint32_t i = 0; i < PERF_COUNTER_COUNT; i++){
+	    stats->copy_counters.values[i].store(perf_totals.values[i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+	  }
+	}
+      }
     }
+    presents->finish(ticket);
+    releaseImage(index);
 }
-void PrimusSwapchain::run(){
-  while(true){
-    QueueItem *workItem = nullptr;
-    {
-      std::unique_lock<std::mutex> lock(queueMutex);
-      has_work.wait(lock, [this](){return !active || work.size() > 0;});
-      if(!active) return;
-      in_progress.push_back(std::move(work.front()));
-      workItem = &in_progress.back();
-      work.pop_front();
-    }
-    present(*workItem);
+bool PrimusSwapchain::presentNext(){
+  QueueItem workItem;
+  uint32_t ticket;
+  if(!presents->tryClaim(workItem, ticket)){
+    return false;
   }
+  present(workItem, ticket);
+  return true;
 }
 
 VkResult VKAPI_CALL PrimusVK_QueueSubmit(VkQueue queue, uint32_t submitCount,
@@ -1162,6 +3715,7 @@ VkResult VKAPI_CALL PrimusVK_QueueSubmit(VkQueue queue, uint32_t submitCount,
 }
 
 VkResult VKAPI_CALL PrimusVK_QueuePresentKHR(VkQueue queue, const VkPresentInfoKHR* pPresentInfo) {
+  TRACE_SCOPE("queue", pPresentInfo->pImageIndices[0]);
   scoped_lock lock(*device_instance_info[GetKey(queue)]->renderQueueMutex);
   auto start = std::chrono::steady_clock::now();
   if(pPresentInfo->swapchainCount != 1){
@@ -1170,21 +3724,10 @@ VkResult VKAPI_CALL PrimusVK_QueuePresentKHR(VkQueue queue, const VkPresentInfoK
 
   PrimusSwapchain *ch = reinterpret_cast<PrimusSwapchain*>(pPresentInfo->pSwapchains[0]);
   double secs = std::chrono::duration_cast<std::chrono::duration<double>>(start - ch->lastPresent).count();
-  TRACE_PROFILING_EVENT(pPresentInfo->pImageIndices[0], "QueuePresent");
   TRACE_PROFILING(" === Time between VkQueuePresents: " << secs << " -> " << 1/secs << " FPS");
-  if(ch->max_fps != 0) {
-    const auto timeBetweenFrame = std::chrono::milliseconds(1000) / ch->max_fps;
-    const auto toSleep = ch->lastPresent + timeBetweenFrame - start;
-    if(toSleep > std::chrono::seconds(0)){
-      std::this_thread::sleep_for(toSleep);
-      start = std::chrono::steady_clock::now();
-    }
-    ch->lastPresent = start;
-  }
+  ch->lastPresent = start;
 
-  ch->queue(queue, pPresentInfo);
-
-  return VK_SUCCESS;
+  return ch->queue(queue, pPresentInfo);
 }
 
 void VKAPI_CALL PrimusVK_GetPhysicalDeviceQueueFamilyProperties(VkPhysicalDevice physicalDevice, uint32_t* pQueueFamilyPropertyCount, VkQueueFamilyProperties* pQueueFamilyProperties) {
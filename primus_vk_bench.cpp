@@ -0,0 +1,578 @@
+#include "primus_vk_copy_pool.h"
+#include "primus_vk_present_ring.h"
+#include "primus_vk_spares.h"
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/mman.h>
+
+// Benchmarks the host copy kernels of primus_vk on plain host memory.
+// It does not need a GPU, so mapped device memory is only approximated.
+
+const auto self = std::string{"PrimusVK-bench: "};
+
+struct Resolution {
+  const char *name;
+  size_t width;
+  size_t height;
+};
+
+const Resolution resolutions[] = {
+  {"1080p", 1920, 1080},
+  {"1440p", 2560, 1440},
+  {"4K", 3840, 2160},
+};
+
+struct AlignedBuffer {
+  char *data;
+  AlignedBuffer(size_t size){
+    data = static_cast<char*>(aligned_alloc(4096, (size + 4095) / 4096 * 4096));
+    if(data == nullptr){
+      throw std::bad_alloc();
+    }
+    std::memset(data, 1, size);
+  }
+  AlignedBuffer(const AlignedBuffer &) = delete;
+  ~AlignedBuffer(){
+    free(data);
+  }
+};
+
+double runCopy(const CopyKernel &kernel, AlignedBuffer &dst, AlignedBuffer &src, size_t pitch, size_t size, int iterations){
+  copyImageRows(kernel, dst.data, pitch, src.data, pitch, size);
+  auto start = std::chrono::steady_clock::now();
+  for(int i = 0; i < iterations; i++){
+    copyImageRows(kernel, dst.data, pitch, src.data, pitch, size);
+  }
+  auto end = std::chrono::steady_clock::now();
+  return std::chrono::duration<double>(end - start).count() / iterations;
+}
+
+void benchKernels(int iterations){
+  std::cout << self << "copy kernels, " << iterations << " frames each" << std::endl;
+  for(const auto &res: resolutions){
+    const size_t pitch = res.width * 4;
+    const size_t size = pitch * res.height;
+    AlignedBuffer src{size};
+    AlignedBuffer dst{size};
+    for(const auto &kernel: copyKernels()){
+      if(!kernel.supported()){
+        continue;
+      }
+      double secs = runCopy(kernel, dst, src, pitch, size, iterations);
+      std::cout << self << std::setw(6) << res.name << " " << std::setw(8) << kernel.name << ": "
+        << std::fixed << std::setprecision(2) << size / secs / 1e9 << " GB/s, "
+        << std::setprecision(3) << secs * 1e3 << " ms/frame" << std::endl;
+    }
+  }
+}
+
+// Frame copy time of the selected kernel at 4K against the number of threads
+// taking part, once with matching and once with mismatched row pitches.
+void benchPool(int iterations){
+  const auto &kernel = selectCopyKernel();
+  const size_t width = 3840;
+  const size_t height = 2160;
+  const size_t srcPitch = width * 4;
+  const size_t dstPitch = srcPitch + 256;
+  AlignedBuffer src{srcPitch * height};
+  AlignedBuffer dst{dstPitch * height};
+  const size_t maxParticipants = std::max(4u, std::thread::hardware_concurrency());
+  std::cout << self << "copy pool, 4K, kernel " << kernel.name << ", " << iterations << " frames each" << std::endl;
+  for(size_t participants = 1; participants <= maxParticipants; participants++){
+    CopyPool pool{participants - 1};
+    for(size_t pitch: {srcPitch, dstPitch}){
+      pool.copyImage(kernel, dst.data, pitch, src.data, srcPitch, srcPitch * height);
+      auto start = std::chrono::steady_clock::now();
+      for(int i = 0; i < iterations; i++){
+        pool.copyImage(kernel, dst.data, pitch, src.data, srcPitch, srcPitch * height);
+      }
+      double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() / iterations;
+      std::cout << self << std::setw(2) << participants << " threads, " << (pitch == srcPitch ? "matching  " : "mismatched") << " pitch: "
+        << std::fixed << std::setprecision(3) << secs * 1e3 << " ms/frame" << std::endl;
+    }
+  }
+}
+
+size_t alignUp(size_t value, size_t alignment){
+  return (value + alignment - 1) / alignment * alignment;
+}
+
+// Host side of the two staging modes (PRIMUS_VK_STAGING). Linear images get
+// a driver-chosen row pitch on each GPU, modelled here as 256 byte aligned on
+// the render side and 64 byte aligned on the display side. Staging buffers
+// are tightly packed on both sides.
+void benchStaging(int iterations){
+  const Resolution sizes[] = {
+    {"1366x768", 1366, 768},
+    {"1080p", 1920, 1080},
+    {"3440x1440", 3440, 1440},
+  };
+  const auto &kernel = selectCopyKernel();
+  auto &pool = CopyPool::shared();
+  std::cout << self << "staging, kernel " << kernel.name << ", " << pool.threadCount() + 1 << " threads, " << iterations << " frames each" << std::endl;
+  for(const auto &res: sizes){
+    const size_t packed = res.width * 4;
+    const size_t srcPitch = alignUp(packed, 256);
+    const size_t dstPitch = alignUp(packed, 64);
+    AlignedBuffer src{srcPitch * res.height};
+    AlignedBuffer dst{dstPitch * res.height};
+    struct Mode {
+      const char *name;
+      size_t srcPitch;
+      size_t dstPitch;
+    };
+    for(const Mode &mode: {Mode{"image", srcPitch, dstPitch}, Mode{"buffer", packed, packed}}){
+      pool.copyImage(kernel, dst.data, mode.dstPitch, src.data, mode.srcPitch, mode.srcPitch * res.height);
+      auto start = std::chrono::steady_clock::now();
+      for(int i = 0; i < iterations; i++){
+        pool.copyImage(kernel, dst.data, mode.dstPitch, src.data, mode.srcPitch, mode.srcPitch * res.height);
+      }
+      double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() / iterations;
+      std::cout << self << std::setw(9) << res.name << " " << std::setw(6) << mode.name << " (pitch " << mode.srcPitch << " -> " << mode.dstPitch << "): "
+        << std::fixed << std::setprecision(3) << secs * 1e3 << " ms/frame" << std::endl;
+    }
+  }
+}
+
+// A swapchain for the shared present threads: checks that its frames
+// finish in push order.
+struct BenchSource: PresentSource {
+  PresentRing<uint32_t> ring{4};
+  uint32_t next = 0;
+  bool ordered = true;
+
+  bool presentNext() override {
+    uint32_t frame, ticket;
+    if(!ring.tryClaim(frame, ticket)){
+      return false;
+    }
+    ring.awaitTurn(ticket);
+    ordered = ordered && frame == next && ticket == next;
+    next++;
+    ring.finish(ticket);
+    return true;
+  }
+  uint32_t backlog() override {
+    return ring.backlog();
+  }
+};
+
+// Hand-off cost of the present ring: the producers push frames like
+// vkQueuePresentKHR, the present threads claim them and finish them in
+// order. The frames carry no work, so this measures pure synchronization
+// overhead.
+bool benchPresentRing(int iterations){
+  const uint32_t frames = iterations * 1000;
+  const uint32_t swapchains = 3;
+  std::cout << self << "present threads, " << swapchains << " swapchains, " << frames << " frames each" << std::endl;
+  for(bool backlogFirst: {false, true}){
+    for(uint32_t workers = 1; workers <= 8; workers *= 2){
+      PresentExecutor executor{workers, backlogFirst};
+      std::vector<std::unique_ptr<BenchSource>> sources;
+      std::vector<PresentExecutor::Handle> entries;
+      for(uint32_t i = 0; i < swapchains; i++){
+        sources.emplace_back(new BenchSource);
+        entries.push_back(executor.add(sources.back().get()));
+      }
+      auto start = std::chrono::steady_clock::now();
+      std::vector<std::thread> producers;
+      for(auto &source: sources){
+        producers.emplace_back([&executor, &source, frames](){
+          for(uint32_t frame = 0; frame < frames; frame++){
+            source->ring.waitPending(2);
+            source->ring.push(frame);
+            executor.notify();
+          }
+          source->ring.waitPending(0);
+        });
+      }
+      for(auto &producer: producers){
+        producer.join();
+      }
+      double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() / (frames * swapchains);
+      for(uint32_t i = 0; i < swapchains; i++){
+        executor.remove(entries[i]);
+      }
+      std::cout << self << (backlogFirst ? "backlog" : "fair") << ", " << workers << " threads: "
+        << std::fixed << std::setprecision(1) << secs * 1e9 << " ns/frame" << std::endl;
+      for(auto &source: sources){
+        if(!source->ordered || source->next != frames){
+          std::cerr << self << "frames finished out of order" << std::endl;
+          return false;
+        }
+      }
+    }
+  }
+  return true;
+}
+
+// Host side of recreating a swapchain during a window drag, one swapchain
+// per size, until the old one is destroyed. Fresh: like a swapchain that
+// starts and joins its own threads and faults in new staging memory for
+// every image. Recycled: registers with the shared present threads and
+// takes over the old swapchain's staging memory with the layer's takeover
+// rules while it is large enough. Render images are created anew either
+// way and live in device memory, so they are left out.
+void benchResizeStorm(int iterations){
+  const size_t images = 3;
+  const size_t bytesPerPixel = 4;
+  std::cout << self << "resize storm, " << iterations << " swapchains of " << images << " images" << std::endl;
+  struct Staging {
+    char *data;
+    size_t size;
+    Staging(size_t bytes): size((bytes + 4095) / 4096 * 4096){
+      data = static_cast<char*>(aligned_alloc(4096, size));
+      if(data == nullptr){
+        throw std::bad_alloc();
+      }
+      prepareHostPages(data, size);
+    }
+    Staging(const Staging &) = delete;
+    ~Staging(){
+      releaseHostPages(data, size);
+      free(data);
+    }
+  };
+  // The staging side of an ImageWorker.
+  struct Worker {
+    std::shared_ptr<Staging> render_copy;
+    std::shared_ptr<Staging> display_src;
+    struct {
+      std::shared_ptr<Staging> render_copy;
+      std::shared_ptr<Staging> display_src;
+    } spares;
+    void takeOver(Worker &donor){
+      spares.render_copy = takeFromDonor(donor.render_copy, donor.spares.render_copy);
+      spares.display_src = takeFromDonor(donor.display_src, donor.spares.display_src);
+    }
+    void init(size_t frameSize){
+      auto fits = [frameSize](const Staging &staging){ return staging.size >= frameSize; };
+      if(!takeSpare(render_copy, spares.render_copy, fits)){
+        render_copy = std::make_shared<Staging>(frameSize);
+      }
+      if(!takeSpare(display_src, spares.display_src, fits)){
+        display_src = std::make_shared<Staging>(frameSize);
+      }
+      spares = {};
+    }
+  };
+  struct NoFrames: PresentSource {
+    bool presentNext() override { return false; }
+    uint32_t backlog() override { return 0; }
+  } source;
+  PresentExecutor executor{images, false};
+
+  for(bool recycle: {false, true}){
+    std::vector<Worker> old;
+    double total = 0, worst = 0;
+    for(int i = 0; i < iterations; i++){
+      // Dragging a corner back and forth around 1600x900.
+      const size_t width = 1600 + (i * 37) % 320 - 160;
+      const size_t height = 900 + (i * 23) % 180 - 90;
+      const size_t frameSize = width * height * bytesPerPixel;
+      auto start = std::chrono::steady_clock::now();
+      if(recycle){
+        executor.remove(executor.add(&source));
+      }else{
+        std::vector<std::thread> threads;
+        for(size_t t = 0; t < images; t++){
+          threads.emplace_back([](){});
+        }
+        for(auto &thread: threads){
+          thread.join();
+        }
+      }
+      std::vector<Worker> workers(images);
+      for(size_t w = 0; w < images; w++){
+        if(recycle && w < old.size()){
+          workers[w].takeOver(old[w]);
+        }
+        workers[w].init(frameSize);
+      }
+      // The application destroys the old swapchain with what was not taken over.
+      old = std::move(workers);
+      const double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+      total += secs;
+      worst = std::max(worst, secs);
+    }
+    std::cout << self << std::setw(9) << (recycle ? "recycled" : "fresh") << ": "
+      << std::fixed << std::setprecision(3) << total / iterations * 1e3 << " ms mean, " << worst * 1e3 << " ms worst" << std::endl;
+  }
+}
+
+// A swapchain with a pool of `depth` render images. The application thread
+// renders (sleeps) into a free image and presents it; the present thread
+// copies the frame on the host, shows it at the next vblank and gives the
+// image back.
+struct RenderAheadSource: PresentSource {
+  struct Frame {
+    uint32_t image;
+    std::chrono::steady_clock::time_point started;
+  };
+  PresentRing<Frame> ring;
+  std::vector<std::unique_ptr<AlignedBuffer>> rendered;
+  AlignedBuffer display;
+  size_t pitch, size;
+  std::chrono::steady_clock::time_point epoch = std::chrono::steady_clock::now();
+  std::chrono::microseconds vblank;
+  std::mutex mutex;
+  std::condition_variable changed;
+  std::deque<uint32_t> free_images;
+  // Render start to vblank, summed over all frames.
+  double latency = 0;
+
+  RenderAheadSource(uint32_t depth, size_t pitch, size_t size, std::chrono::microseconds vblank):
+    ring(depth), display(size), pitch(pitch), size(size), vblank(vblank){
+    for(uint32_t i = 0; i < depth; i++){
+      rendered.emplace_back(new AlignedBuffer(size));
+      free_images.push_back(i);
+    }
+  }
+  uint32_t acquire(){
+    std::unique_lock<std::mutex> lock(mutex);
+    changed.wait(lock, [this](){ return !free_images.empty(); });
+    const uint32_t image = free_images.front();
+    free_images.pop_front();
+    return image;
+  }
+  bool presentNext() override {
+    Frame frame;
+    uint32_t ticket;
+    if(!ring.tryClaim(frame, ticket)){
+      return false;
+    }
+    copyImageRows(selectCopyKernel(), display.data, pitch, rendered[frame.image]->data, pitch, size);
+    ring.awaitTurn(ticket);
+    const auto now = std::chrono::steady_clock::now();
+    const auto shown = epoch + ((now - epoch) / vblank + 1) * vblank;
+    std::this_thread::sleep_until(shown);
+    latency += std::chrono::duration<double>(shown - frame.started).count();
+    ring.finish(ticket);
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      free_images.push_back(frame.image);
+    }
+    changed.notify_one();
+    return true;
+  }
+  uint32_t backlog() override {
+    return ring.backlog();
+  }
+};
+
+// Latency and throughput per render image pool depth
+// (PRIMUS_VK_RENDER_IMAGES), once limited by the display and once by the
+// host copy of a larger frame.
+void benchRenderAhead(int iterations){
+  struct Scenario {
+    const char *name;
+    const Resolution &res;
+    std::chrono::microseconds render;
+    std::chrono::microseconds vblank;
+  };
+  const Scenario scenarios[] = {
+    {"display bound, 144 Hz", resolutions[0], std::chrono::microseconds(3000), std::chrono::microseconds(6944)},
+    {"copy bound, 360 Hz", resolutions[2], std::chrono::microseconds(1000), std::chrono::microseconds(2778)},
+  };
+  PresentExecutor executor{1, false};
+  for(const auto &scenario: scenarios){
+    const size_t pitch = scenario.res.width * 4;
+    const size_t size = pitch * scenario.res.height;
+    std::cout << self << "render-ahead, " << scenario.name << ", " << scenario.res.name << ", "
+      << iterations << " frames" << std::endl;
+    for(uint32_t depth = 2; depth <= 5; depth++){
+      RenderAheadSource source{depth, pitch, size, scenario.vblank};
+      auto entry = executor.add(&source);
+      const auto start = std::chrono::steady_clock::now();
+      for(int i = 0; i < iterations; i++){
+        const uint32_t image = source.acquire();
+        const auto started = std::chrono::steady_clock::now();
+        std::this_thread::sleep_until(started + scenario.render);
+        source.ring.push(RenderAheadSource::Frame{image, started});
+        executor.notify();
+      }
+      source.ring.waitPending(0);
+      const double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+      executor.remove(entry);
+      std::cout << self << depth << " images: " << std::fixed << std::setprecision(1)
+        << iterations / secs << " fps, " << std::setprecision(2) << source.latency / iterations * 1e3 << " ms latency" << std::endl;
+    }
+  }
+}
+
+// Host memory for the copy suite, standing in for mapped device memory.
+// Hugepage buffers come from hugetlbfs if pages are reserved
+// (vm.nr_hugepages), otherwise from transparent huge pages.
+struct HostBuffer {
+  char *data = nullptr;
+  size_t size = 0;
+  const char *backing = "malloc";
+  bool mapped = false;
+
+  HostBuffer(size_t bytes, bool hugepages){
+    const size_t huge = 2 << 20;
+    if(hugepages){
+      size = alignUp(bytes, huge);
+      void *p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+      backing = "hugetlb";
+      if(p == MAP_FAILED){
+        p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        backing = "thp";
+        if(p != MAP_FAILED){
+          madvise(p, size, MADV_HUGEPAGE);
+        }
+      }
+      if(p == MAP_FAILED){
+        throw std::bad_alloc();
+      }
+      data = static_cast<char*>(p);
+      mapped = true;
+    }else{
+      size = alignUp(bytes, 4096);
+      data = static_cast<char*>(aligned_alloc(4096, size));
+      if(data == nullptr){
+        throw std::bad_alloc();
+      }
+    }
+    for(size_t i = 0; i < size; i++){
+      data[i] = char(i * 7 + i / 4093);
+    }
+  }
+  HostBuffer(const HostBuffer &) = delete;
+  ~HostBuffer(){
+    if(mapped){
+      munmap(data, size);
+    }else{
+      free(data);
+    }
+  }
+};
+
+// Machine readable regression suite (`make bench`): the frame copy of
+// ImageWorker::copyImageData, CopyPool::copyImage with the selected kernel
+// on the shared pool, over every combination of resolution, row pitch
+// layout and backing memory. Each case reports the median and fastest
+// frame and checks that the copied rows arrived intact.
+bool benchCopySuite(int iterations, std::ostream &out){
+  const Resolution sizes[] = {
+    {"720p", 1280, 720},
+    {"1080p", 1920, 1080},
+    {"1440p", 2560, 1440},
+    {"4K", 3840, 2160},
+    {"8K", 7680, 4320},
+  };
+  struct Layout {
+    const char *name;
+    size_t srcPitch;
+    size_t dstPitch;
+    // Offset of the first pixel from the start of the buffer.
+    size_t srcOffset;
+    size_t dstOffset;
+  };
+  const auto &kernel = selectCopyKernel();
+  auto &pool = CopyPool::shared();
+  bool ok = true;
+  out << "{\n  \"benchmark\": \"primus_vk_copy\",\n  \"kernel\": \"" << kernel.name << "\",\n  \"threads\": " << pool.threadCount() + 1
+      << ",\n  \"iterations\": " << iterations << ",\n  \"results\": [";
+  bool first = true;
+  for(const auto &res: sizes){
+    const size_t packed = res.width * 4;
+    const Layout layouts[] = {
+      // Staging buffers: tightly packed on both GPUs.
+      {"matching", packed, packed, 0, 0},
+      // Linear images with the pitch alignments drivers commonly pick.
+      {"mismatched", alignUp(packed, 256), alignUp(packed, 64), 0, 0},
+      // Pitches and start addresses that are not multiples of any vector
+      // width.
+      {"odd", packed + 12, packed + 20, 4, 8},
+    };
+    for(const Layout &layout: layouts){
+      for(bool hugepages: {false, true}){
+        const size_t srcSize = layout.srcPitch * res.height;
+        HostBuffer src{layout.srcOffset + srcSize, hugepages};
+        HostBuffer dst{layout.dstOffset + layout.dstPitch * res.height, hugepages};
+        char *from = src.data + layout.srcOffset;
+        char *to = dst.data + layout.dstOffset;
+        pool.copyImage(kernel, to, layout.dstPitch, from, layout.srcPitch, srcSize);
+        bool intact = true;
+        for(size_t y = 0; y < res.height && intact; y++){
+          intact = memcmp(to + y * layout.dstPitch, from + y * layout.srcPitch, packed) == 0;
+        }
+        ok = ok && intact;
+        std::vector<double> times(iterations);
+        for(auto &time: times){
+          auto start = std::chrono::steady_clock::now();
+          pool.copyImage(kernel, to, layout.dstPitch, from, layout.srcPitch, srcSize);
+          time = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+        }
+        std::sort(times.begin(), times.end());
+        const double median = times[times.size() / 2];
+        const double fastest = times[0];
+        const size_t bytes = packed * res.height;
+        out << (first ? "" : ",") << "\n    {\"resolution\": \"" << res.name << "\", \"width\": " << res.width << ", \"height\": " << res.height
+            << ", \"layout\": \"" << layout.name << "\", \"src_pitch\": " << layout.srcPitch << ", \"dst_pitch\": " << layout.dstPitch
+            << ", \"memory\": \"" << (hugepages ? "hugepage" : "normal") << "\", \"backing\": \"" << src.backing << "\""
+            << ", \"bytes\": " << bytes << std::fixed << std::setprecision(0)
+            << ", \"ns_per_frame\": " << median << ", \"ns_per_frame_min\": " << fastest << std::setprecision(3)
+            << ", \"gb_per_s\": " << bytes / median << ", \"intact\": " << (intact ? "true" : "false") << "}";
+        first = false;
+      }
+    }
+  }
+  out << "\n  ]\n}" << std::endl;
+  return ok;
+}
+
+int main(int argc, char **argv){
+  int iterations = 100;
+  bool json = false;
+  std::string jsonFile;
+  for(int i = 1; i < argc; i++){
+    std::string arg = argv[i];
+    if(arg == "-n" && i + 1 < argc){
+      iterations = std::max(1, std::stoi(argv[++i]));
+    } else if(arg == "--json"){
+      json = true;
+      if(i + 1 < argc && argv[i + 1][0] != '-'){
+        jsonFile = argv[++i];
+      }
+    } else {
+      std::cerr << "usage: " << argv[0] << " [-n frames] [--json [file]]" << std::endl;
+      return 1;
+    }
+  }
+  if(json){
+    bool ok;
+    if(jsonFile.empty()){
+      ok = benchCopySuite(iterations, std::cout);
+    }else{
+      std::ofstream out{jsonFile};
+      ok = benchCopySuite(iterations, out);
+    }
+    if(!ok){
+      std::cerr << self << "copied frames differ from their source" << std::endl;
+    }
+    return ok ? 0 : 1;
+  }
+  std::cout << self << "selected kernel: " << selectCopyKernel().name << std::endl;
+  benchKernels(iterations);
+  benchPool(iterations);
+  benchStaging(iterations);
+  benchResizeStorm(iterations);
+  benchRenderAhead(iterations);
+  return benchPresentRing(iterations) ? 0 : 1;
+}
@@ -0,0 +1,234 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define PRIMUS_VK_COPY_X86
+#endif
+
+// Host copy kernels for moving a frame from the render GPU's mapped image
+// into the display GPU's mapped image.
+//
+// The source is usually HOST_CACHED memory written by the render GPU, the
+// destination HOST_COHERENT memory of the display GPU, which is typically
+// write-combined. Streaming (non-temporal) stores avoid reading the
+// destination lines into the cache and polluting it with a whole frame.
+
+// How far ahead of the current load the source is prefetched. Only relevant
+// for cached source memory, the prefetch is dropped on uncached mappings.
+constexpr size_t prefetch_distance = 1024;
+
+typedef void (*CopyRowsFn)(char *dst, size_t dstPitch, const char *src, size_t srcPitch, size_t rowBytes, size_t rows);
+
+struct CopyKernel {
+  const char *name;
+  bool (*supported)();
+  // Copies `rows` rows of `rowBytes` each. For a single contiguous block
+  // pass rows = 1; the pitches are ignored then.
+  CopyRowsFn copyRows;
+};
+
+inline void copyRowsMemcpy(char *dst, size_t dstPitch, const char *src, size_t srcPitch, size_t rowBytes, size_t rows){
+  for(size_t row = 0; row < rows; row++){
+    std::memcpy(dst + row * dstPitch, src + row * srcPitch, rowBytes);
+  }
+}
+
+#ifdef PRIMUS_VK_COPY_X86
+// One template per instruction set. `SrcAligned` selects the streaming-load
+// variant, which requires the source to be aligned to the vector width. The
+// destination is always brought to alignment first, streaming stores require
+// it. `Aligned` rows (both pointers and both pitches are multiples of the
+// vector width) skip the per-row head handling altogether.
+template<bool SrcAligned>
+__attribute__((target("sse4.1"))) inline void copyBlockSSE41(char *dst, const char *src, size_t bytes){
+  size_t i = 0;
+  for(; i + 64 <= bytes; i += 64){
+    _mm_prefetch(src + i + prefetch_distance, _MM_HINT_NTA);
+    __m128i a, b, c, d;
+    if(SrcAligned){
+      a = _mm_stream_load_si128((__m128i*)(src + i));
+      b = _mm_stream_load_si128((__m128i*)(src + i + 16));
+      c = _mm_stream_load_si128((__m128i*)(src + i + 32));
+      d = _mm_stream_load_si128((__m128i*)(src + i + 48));
+    } else {
+      a = _mm_loadu_si128((const __m128i*)(src + i));
+      b = _mm_loadu_si128((const __m128i*)(src + i + 16));
+      c = _mm_loadu_si128((const __m128i*)(src + i + 32));
+      d = _mm_loadu_si128((const __m128i*)(src + i + 48));
+    }
+    _mm_stream_si128((__m128i*)(dst + i), a);
+    _mm_stream_si128((__m128i*)(dst + i + 16), b);
+    _mm_stream_si128((__m128i*)(dst + i + 32), c);
+    _mm_stream_si128((__m128i*)(dst + i + 48), d);
+  }
+  std::memcpy(dst + i, src + i, bytes - i);
+}
+
+template<bool SrcAligned>
+__attribute__((target("avx2"))) inline void copyBlockAVX2(char *dst, const char *src, size_t bytes){
+  size_t i = 0;
+  for(; i + 64 <= bytes; i += 64){
+    _mm_prefetch(src + i + prefetch_distance, _MM_HINT_NTA);
+    __m256i a, b;
+    if(SrcAligned){
+      a = _mm256_stream_load_si256((__m256i*)(src + i));
+      b = _mm256_stream_load_si256((__m256i*)(src + i + 32));
+    } else {
+      a = _mm256_loadu_si256((const __m256i*)(src + i));
+      b = _mm256_loadu_si256((const __m256i*)(src + i + 32));
+    }
+    _mm256_stream_si256((__m256i*)(dst + i), a);
+    _mm256_stream_si256((__m256i*)(dst + i + 32), b);
+  }
+  std::memcpy(dst + i, src + i, bytes - i);
+}
+
+template<bool SrcAligned>
+__attribute__((target("avx512f"))) inline void copyBlockAVX512(char *dst, const char *src, size_t bytes){
+  size_t i = 0;
+  for(; i + 128 <= bytes; i += 128){
+    _mm_prefetch(src + i + prefetch_distance, _MM_HINT_NTA);
+    _mm_prefetch(src + i + prefetch_distance + 64, _MM_HINT_NTA);
+    __m512i a, b;
+    if(SrcAligned){
+      a = _mm512_stream_load_si512((void*)(src + i));
+      b = _mm512_stream_load_si512((void*)(src + i + 64));
+    } else {
+      a = _mm512_loadu_si512((const void*)(src + i));
+      b = _mm512_loadu_si512((const void*)(src + i + 64));
+    }
+    _mm512_stream_si512((__m512i*)(dst + i), a);
+    _mm512_stream_si512((__m512i*)(dst + i + 64), b);
+  }
+  std::memcpy(dst + i, src + i, bytes - i);
+}
+
+template<size_t Width, void (*Aligned)(char*, const char*, size_t), void (*Unaligned)(char*, const char*, size_t)>
+__attribute__((target("sse2"))) inline void copyRowsStreaming(char *dst, size_t dstPitch, const char *src, size_t srcPitch, size_t rowBytes, size_t rows){
+  constexpr uintptr_t mask = Width - 1;
+  if(rows == 1){
+    dstPitch = 0;
+    srcPitch = 0;
+  }
+  const bool aligned = (((uintptr_t)dst | (uintptr_t)src | dstPitch | srcPitch) & mask) == 0;
+  for(size_t row = 0; row < rows; row++){
+    char *d = dst + row * dstPitch;
+    const char *s = src + row * srcPitch;
+    size_t bytes = rowBytes;
+    if(!aligned){
+      size_t head = (Width - ((uintptr_t)d & mask)) & mask;
+      if(head > bytes){
+        head = bytes;
+      }
+      std::memcpy(d, s, head);
+      d += head;
+      s += head;
+      bytes -= head;
+      if(((uintptr_t)s & mask) != 0){
+        Unaligned(d, s, bytes);
+        continue;
+      }
+    }
+    Aligned(d, s, bytes);
+  }
+  // Streaming stores are weakly ordered, make them visible before the
+  // display GPU is told to read the image.
+  _mm_sfence();
+}
+
+inline bool supportsSSE41(){ return __builtin_cpu_supports("sse4.1"); }
+inline bool supportsAVX2(){ return __builtin_cpu_supports("avx2"); }
+inline bool supportsAVX512(){ return __builtin_cpu_supports("avx512f"); }
+#endif
+
+inline bool supportsAlways(){ return true; }
+
+// All kernels compiled into this build, the first one is the fallback.
+inline const std::vector<CopyKernel> &copyKernels(){
+  static const std::vector<CopyKernel> kernels = {
+    {"memcpy", supportsAlways, copyRowsMemcpy},
+#ifdef PRIMUS_VK_COPY_X86
+    {"sse4.1", supportsSSE41, copyRowsStreaming<16, copyBlockSSE41<true>, copyBlockSSE41<false>>},
+    {"avx2", supportsAVX2, copyRowsStreaming<32, copyBlockAVX2<true>, copyBlockAVX2<false>>},
+    {"avx512", supportsAVX512, copyRowsStreaming<64, copyBlockAVX512<true>, copyBlockAVX512<false>>},
+#endif
+  };
+  return kernels;
+}
+
+// Times every kernel this CPU supports on a frame sized copy and returns
+// the fastest. The widest kernel is not always it: on some CPUs AVX-512
+// streaming stores run at half of memcpy's bandwidth.
+inline const CopyKernel &calibrateCopyKernel(){
+  const auto &kernels = copyKernels();
+  // About one 1080p frame, larger than the caches.
+  const size_t bytes = size_t{8} << 20;
+  char *src = static_cast<char*>(aligned_alloc(4096, bytes));
+  char *dst = static_cast<char*>(aligned_alloc(4096, bytes));
+  if(src == nullptr || dst == nullptr){
+    free(src);
+    free(dst);
+    return kernels.front();
+  }
+  std::memset(src, 1, bytes);
+  std::memset(dst, 0, bytes);
+  const CopyKernel *best = &kernels.front();
+  auto fastest = std::chrono::steady_clock::duration::max();
+  for(const auto &kernel: kernels){
+    if(!kernel.supported()){
+      continue;
+    }
+    kernel.copyRows(dst, 0, src, 0, bytes, 1);
+    for(int run = 0; run < 3; run++){
+      const auto start = std::chrono::steady_clock::now();
+      kernel.copyRows(dst, 0, src, 0, bytes, 1);
+      const auto took = std::chrono::steady_clock::now() - start;
+      if(took < fastest){
+        fastest = took;
+        best = &kernel;
+      }
+    }
+  }
+  free(src);
+  free(dst);
+  return *best;
+}
+
+// Picks the kernel named in PRIMUS_VK_COPY_KERNEL, otherwise the fastest
+// one in a short calibration run. The choice is made once per process.
+inline const CopyKernel &selectCopyKernel(){
+  static const CopyKernel *selected = [](){
+    const auto &kernels = copyKernels();
+    const char *env = getenv("PRIMUS_VK_COPY_KERNEL");
+    if(env != nullptr){
+      for(const auto &kernel: kernels){
+        if(std::string{env} == kernel.name && kernel.supported()){
+          return &kernel;
+        }
+      }
+    }
+    return &calibrateCopyKernel();
+  }();
+  return *selected;
+}
+
+// The row copy of ImageWorker::copyImageData: with matching pitches the
+// image is one contiguous block, otherwise it is copied row by row with the
+// smaller of both pitches.
+inline void copyImageRows(const CopyKernel &kernel, char *dst, size_t dstPitch, const char *src, size_t srcPitch, size_t srcSize){
+  if(srcPitch == dstPitch){
+    kernel.copyRows(dst, 0, src, 0, srcSize, 1);
+    return;
+  }
+  const size_t minRowPitch = srcPitch < dstPitch ? srcPitch : dstPitch;
+  const size_t rows = (srcSize + srcPitch - 1) / srcPitch;
+  kernel.copyRows(dst, dstPitch, src, srcPitch, minRowPitch, rows);
+}
@@ -0,0 +1,250 @@
+#pragma once
+
+#include "primus_vk_copy.h"
+#include "primus_vk_perf.h"
+#include "primus_vk_placement.h"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <pthread.h>
+
+// Splits a frame copy into row bands and runs them on a shared pool of copy
+// threads, so one frame is not limited to the memory bandwidth of one core.
+//
+// The bands of a frame are divided into one contiguous range per participant
+// (the pool's threads plus the calling thread). Everybody first works through
+// its own range and then steals bands from the other ranges. The caller takes
+// part in the copy and returns once all bands are done.
+//
+// With PRIMUS_VK_PERF_COUNTERS every participant adds its own counters for
+// its share of the copy to the PerfTotals passed in.
+
+class Latch {
+  std::mutex mutex;
+  std::condition_variable done;
+  size_t count;
+public:
+  Latch(size_t count): count(count) {}
+  void countDown(size_t n = 1){
+    std::unique_lock<std::mutex> lock(mutex);
+    count -= n;
+    if(count == 0){
+      done.notify_all();
+    }
+  }
+  void wait(){
+    std::unique_lock<std::mutex> lock(mutex);
+    done.wait(lock, [this](){ return count == 0; });
+  }
+};
+
+class CopyPool {
+  // Bands smaller than this are not worth waking up another thread for.
+  static constexpr size_t min_band_bytes = 128 * 1024;
+  // Bands per participant, more bands make stealing finer grained.
+  static constexpr size_t bands_per_participant = 4;
+
+  struct Range {
+    std::atomic<size_t> next{0};
+    size_t end = 0;
+  };
+  struct Job {
+    const CopyKernel *kernel;
+    char *dst;
+    size_t dstPitch;
+    const char *src;
+    size_t srcPitch;
+    size_t rowBytes;
+    size_t rows;
+    size_t bandRows;
+    std::unique_ptr<Range[]> ranges;
+    size_t rangeCount;
+    std::atomic<size_t> participants{0};
+    PerfTotals *perf = nullptr;
+    Latch latch;
+    Job(size_t bands): latch(bands) {}
+
+    void copyBand(size_t band){
+      const size_t first = band * bandRows;
+      const size_t count = std::min(bandRows, rows - first);
+      char *d = dst + first * dstPitch;
+      const char *s = src + first * srcPitch;
+      if(rowBytes == dstPitch && rowBytes == srcPitch){
+        kernel->copyRows(d, 0, s, 0, rowBytes * count, 1);
+      } else {
+        kernel->copyRows(d, dstPitch, s, srcPitch, rowBytes, count);
+      }
+    }
+    bool claim(Range &range, size_t &band){
+      if(range.next.load(std::memory_order_relaxed) >= range.end){
+        return false;
+      }
+      band = range.next.fetch_add(1, std::memory_order_relaxed);
+      return band < range.end;
+    }
+    // The own range first, then the others.
+    bool claimNext(size_t self, size_t &band){
+      for(size_t i = 0; i < rangeCount; i++){
+        if(claim(ranges[(self + i) % rangeCount], band)){
+          return true;
+        }
+      }
+      return false;
+    }
+    // Works on the own range first, then steals from the others. A pool
+    // thread may only get here after the copy finished; counting starts
+    // with a claimed band and ends before the latch lets the caller return,
+    // as `perf` can be gone after that.
+    void work(){
+      const size_t self = participants.fetch_add(1, std::memory_order_relaxed) % rangeCount;
+      size_t done = 0;
+      size_t band;
+      if(claimNext(self, band)){
+        PerfCounters::Scope counting(perf);
+        do {
+          copyBand(band);
+          done++;
+        } while(claimNext(self, band));
+      }
+      if(done > 0){
+        latch.countDown(done);
+      }
+    }
+  };
+
+  std::mutex mutex;
+  std::condition_variable has_work;
+  std::deque<std::shared_ptr<Job>> jobs;
+  std::vector<std::thread> threads;
+  bool active = true;
+
+  void run(){
+    ThreadPlacement::Thread &placement = ThreadPlacement::shared().enter("copy-thread");
+    while(true){
+      std::shared_ptr<Job> job;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        has_work.wait(lock, [this](){ return !active || !jobs.empty(); });
+        if(!active) return;
+        job = jobs.front();
+        // Once one participant per range has joined, every band is
+        // reachable by someone, later threads would only steal.
+        if(job->participants.load(std::memory_order_relaxed) + 1 >= job->rangeCount){
+          jobs.pop_front();
+        }
+      }
+      placement.sample();
+      job->work();
+    }
+  }
+public:
+  CopyPool(size_t threadCount){
+    threads.reserve(threadCount);
+    for(size_t i = 0; i < threadCount; i++){
+      threads.emplace_back([this](){ this->run(); });
+      pthread_setname_np(threads.back().native_handle(), "copy-thread");
+    }
+  }
+  CopyPool(const CopyPool &) = delete;
+  ~CopyPool(){
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      active = false;
+      has_work.notify_all();
+    }
+    for(auto &thread: threads){
+      thread.join();
+    }
+  }
+  size_t threadCount() const {
+    return threads.size();
+  }
+
+  // Same contract as CopyKernel::copyRows, but the rows are distributed
+  // over the pool. Returns when all rows have been copied.
+  void copyRows(const CopyKernel &kernel, char *dst, size_t dstPitch, const char *src, size_t srcPitch, size_t rowBytes, size_t rows,
+		PerfTotals *perf = nullptr){
+    const size_t participants = threads.size() + 1;
+    const size_t totalBytes = rowBytes * rows;
+    size_t bands = std::min(participants * bands_per_participant, totalBytes / min_band_bytes);
+    bands = std::min(bands, rows);
+    if(bands <= 1 || threads.empty()){
+      PerfCounters::Scope counting(perf);
+      kernel.copyRows(dst, dstPitch, src, srcPitch, rowBytes, rows);
+      return;
+    }
+    const size_t bandRows = (rows + bands - 1) / bands;
+    bands = (rows + bandRows - 1) / bandRows;
+
+    auto job = std::make_shared<Job>(bands);
+    job->kernel = &kernel;
+    job->dst = dst;
+    job->dstPitch = dstPitch;
+    job->src = src;
+    job->srcPitch = srcPitch;
+    job->rowBytes = rowBytes;
+    job->rows = rows;
+    job->bandRows = bandRows;
+    job->perf = perf;
+    job->rangeCount = std::min(participants, bands);
+    job->ranges.reset(new Range[job->rangeCount]);
+    for(size_t i = 0; i < job->rangeCount; i++){
+      job->ranges[i].next = bands * i / job->rangeCount;
+      job->ranges[i].end = bands * (i + 1) / job->rangeCount;
+    }
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      jobs.push_back(job);
+      has_work.notify_all();
+    }
+    job->work();
+    job->latch.wait();
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      auto it = std::find(jobs.begin(), jobs.end(), job);
+      if(it != jobs.end()){
+        jobs.erase(it);
+      }
+    }
+  }
+
+  // Frame copy with the same pitch handling as copyImageRows.
+  void copyImage(const CopyKernel &kernel, char *dst, size_t dstPitch, const char *src, size_t srcPitch, size_t srcSize,
+		 PerfTotals *perf = nullptr){
+    if(srcPitch == dstPitch){
+      const size_t rows = srcSize / srcPitch;
+      const size_t tail = srcSize - rows * srcPitch;
+      copyRows(kernel, dst, dstPitch, src, srcPitch, srcPitch, rows, perf);
+      if(tail > 0){
+        kernel.copyRows(dst + rows * dstPitch, 0, src + rows * srcPitch, 0, tail, 1);
+      }
+      return;
+    }
+    const size_t minRowPitch = std::min(srcPitch, dstPitch);
+    const size_t rows = (srcSize + srcPitch - 1) / srcPitch;
+    copyRows(kernel, dst, dstPitch, src, srcPitch, minRowPitch, rows, perf);
+  }
+
+  // The layer-wide pool. PRIMUS_VK_COPY_THREADS is the number of threads
+  // taking part in one copy, including the presenting thread; 1 disables
+  // the pool.
+  static CopyPool &shared(){
+    static CopyPool pool{[](){
+      size_t participants = std::min(4u, std::max(1u, std::thread::hardware_concurrency()));
+      const char *env = getenv("PRIMUS_VK_COPY_THREADS");
+      if(env != nullptr){
+        participants = std::max(1, std::stoi(std::string{env}));
+      }
+      return participants - 1;
+    }()};
+    return pool;
+  }
+};
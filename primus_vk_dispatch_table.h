@@ -16,7 +16,10 @@ struct PvkInstanceDispatchTable {
   DECLARE(DestroyInstance);
   DECLARE(EnumerateDeviceExtensionProperties);
   DECLARE(GetPhysicalDeviceProperties);
+  DECLARE(GetPhysicalDeviceProperties2);
+  DECLARE(GetPhysicalDeviceFeatures2);
   DECLARE(GetPhysicalDeviceMemoryProperties);
+  DECLARE(GetPhysicalDeviceFormatProperties);
   DECLARE(GetPhysicalDeviceQueueFamilyProperties);
 #ifdef VK_USE_PLATFORM_XCB_KHR
   DECLARE(GetPhysicalDeviceXcbPresentationSupportKHR);
@@ -55,9 +58,13 @@ struct PvkDispatchTable {
   DECLARE(AcquireNextImageKHR);
   DECLARE(GetSwapchainStatusKHR);
   DECLARE(QueuePresentKHR);
+  DECLARE(GetRefreshCycleDurationGOOGLE);
+  DECLARE(GetPastPresentationTimingGOOGLE);
 
   DECLARE(CreateImage);
   DECLARE(GetImageMemoryRequirements);
+  // Null before Vulkan 1.1, nothing gets a dedicated allocation then.
+  DECLARE(GetImageMemoryRequirements2);
   DECLARE(AllocateMemory);
   DECLARE(BindImageMemory);
   DECLARE(GetImageSubresourceLayout);
@@ -66,13 +73,48 @@ struct PvkDispatchTable {
   DECLARE(MapMemory);
   DECLARE(UnmapMemory);
 
+  DECLARE(CreateBuffer);
+  DECLARE(GetBufferMemoryRequirements);
+  DECLARE(GetBufferMemoryRequirements2);
+  DECLARE(BindBufferMemory);
+  DECLARE(DestroyBuffer);
+  DECLARE(GetMemoryHostPointerPropertiesEXT);
+
+  DECLARE(CreateShaderModule);
+  DECLARE(DestroyShaderModule);
+  DECLARE(CreateDescriptorSetLayout);
+  DECLARE(DestroyDescriptorSetLayout);
+  DECLARE(CreatePipelineLayout);
+  DECLARE(DestroyPipelineLayout);
+  DECLARE(CreateComputePipelines);
+  DECLARE(DestroyPipeline);
+  DECLARE(CreateDescriptorPool);
+  DECLARE(DestroyDescriptorPool);
+  DECLARE(AllocateDescriptorSets);
+  DECLARE(UpdateDescriptorSets);
+
 
   DECLARE(AllocateCommandBuffers);
   DECLARE(BeginCommandBuffer);
   DECLARE(CmdDraw);
   DECLARE(CmdDrawIndexed);
   DECLARE(CmdCopyImage);
+  DECLARE(CmdCopyImageToBuffer);
+  DECLARE(CmdCopyBufferToImage);
+  DECLARE(CmdBlitImage);
   DECLARE(CmdPipelineBarrier);
+  DECLARE(CmdBindPipeline);
+  DECLARE(CmdBindDescriptorSets);
+  DECLARE(CmdPushConstants);
+  DECLARE(CmdDispatch);
+  DECLARE(CmdResetQueryPool);
+  DECLARE(CmdWriteTimestamp);
+  // Null unless the instance enabled VK_EXT_debug_utils.
+  DECLARE(CmdBeginDebugUtilsLabelEXT);
+  DECLARE(CmdEndDebugUtilsLabelEXT);
+  DECLARE(CreateQueryPool);
+  DECLARE(DestroyQueryPool);
+  DECLARE(GetQueryPoolResults);
   DECLARE(CreateCommandPool);
   //DECLARE(CreateDevice);
   DECLARE(EndCommandBuffer);
@@ -93,6 +135,7 @@ struct PvkDispatchTable {
 
   DECLARE(CreateSemaphore);
   DECLARE(DestroySemaphore);
+  DECLARE(WaitSemaphoresKHR);
 
   DECLARE(InvalidateMappedMemoryRanges);
 
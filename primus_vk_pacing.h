@@ -0,0 +1,130 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <thread>
+
+#include <time.h>
+
+// Limits the frame rate of a swapchain (PRIMUS_VK_MAX_FPS) by holding back
+// the application's acquire until the next frame is due.
+//
+// Deadlines are kept in CLOCK_MONOTONIC nanoseconds, the clock Vulkan
+// drivers report presentation times in. Waiting sleeps until shortly
+// before the deadline and spins the rest; the spin margin follows how late
+// the kernel woke the thread recently. A frame that is more than one
+// interval late restarts the schedule instead of letting the following
+// frames catch up in a burst.
+//
+// With a known refresh cycle the interval is rounded to whole refresh
+// cycles and deadlines are moved to the nearest vblank, taken from the
+// presentation times the present threads report.
+
+class FramePacer {
+  static constexpr uint64_t min_spin = 50000;
+  static constexpr uint64_t max_spin = 2000000;
+
+  uint64_t interval = 0;
+  uint64_t requested_interval = 0;
+  uint64_t next = 0;
+  // The deadline of the frame wait() last looked at.
+  uint64_t due = 0;
+  uint64_t spin = 200000;
+  std::atomic<uint64_t> refresh_period{0};
+  // A time at which a frame reached the screen, 0 while unknown.
+  std::atomic<uint64_t> refresh_phase{0};
+
+  static void sleepUntil(uint64_t deadline){
+    timespec ts;
+    ts.tv_sec = deadline / 1000000000;
+    ts.tv_nsec = deadline % 1000000000;
+    while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr) == EINTR){
+    }
+  }
+
+public:
+  static uint64_t now(){
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return uint64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+  }
+
+  // `fps` <= 0 disables pacing.
+  explicit FramePacer(double fps){
+    if(fps > 0){
+      requested_interval = interval = uint64_t(1e9 / fps);
+    }
+  }
+  FramePacer(const FramePacer &) = delete;
+
+  bool enabled() const {
+    return interval != 0;
+  }
+  uint64_t frameInterval() const {
+    return interval;
+  }
+
+  // Refresh cycle of the display in nanoseconds. Call before the first
+  // wait().
+  void setRefreshCycle(uint64_t period){
+    if(period == 0 || requested_interval == 0){
+      return;
+    }
+    const uint64_t cycles = std::max<uint64_t>(1, (requested_interval + period / 2) / period);
+    interval = cycles * period;
+    refresh_period.store(period);
+  }
+  // A frame reached the screen at `time`. Called by the present threads.
+  void presented(uint64_t time){
+    refresh_phase.store(time, std::memory_order_relaxed);
+  }
+
+  // Blocks until the next frame is due, but at most `timeout` nanoseconds.
+  // Returns false if the frame is not due by then. Called by the thread that
+  // acquires; the schedule only moves on once advance() reports the frame
+  // was handed out.
+  bool wait(uint64_t timeout){
+    if(interval == 0){
+      return true;
+    }
+    uint64_t current = now();
+    if(next == 0 || current > next + interval){
+      next = current;
+    }
+    uint64_t deadline = next;
+    const uint64_t period = refresh_period.load();
+    const uint64_t phase = refresh_phase.load(std::memory_order_relaxed);
+    if(period != 0 && phase != 0){
+      const uint64_t offset = (deadline + period - phase % period) % period;
+      deadline = offset < period / 2 ? deadline - offset : deadline + period - offset;
+    }
+    due = deadline;
+    if(deadline > current && deadline - current > timeout){
+      if(timeout != 0){
+        sleepUntil(current + timeout);
+      }
+      return false;
+    }
+    if(deadline > current + spin){
+      sleepUntil(deadline - spin);
+      const uint64_t woke = now();
+      // Oversleeping past the point the spin should start.
+      const uint64_t late = woke > deadline - spin ? woke - (deadline - spin) : 0;
+      spin = std::min(max_spin, std::max(min_spin, (spin * 7 + late * 2) / 8));
+      current = woke;
+    }
+    while(current < deadline){
+      std::this_thread::yield();
+      current = now();
+    }
+    return true;
+  }
+  // The frame wait() let through was handed out.
+  void advance(){
+    if(interval != 0){
+      next = due + interval;
+    }
+  }
+};
@@ -0,0 +1,152 @@
+#pragma once
+
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Hardware and software counters around the host copy
+// (PRIMUS_VK_PERF_COUNTERS=1), to tell uncached reads from mapped device
+// memory (cycles per instruction), cache misses, page faults and preemption
+// apart.
+//
+// Every thread taking part in a copy opens its own counter group with
+// perf_event_open on first use and adds what the counters advanced during
+// its share of the copy to the swapchain's PerfTotals. Counters the kernel
+// does not permit (perf_event_paranoid, containers, virtual machines without
+// a PMU) are left out without a message; with none left the thread does not
+// count at all.
+
+enum PerfCounter {
+  PERF_CYCLES,
+  PERF_INSTRUCTIONS,
+  PERF_LLC_MISSES,
+  PERF_PAGE_FAULTS,
+  PERF_CONTEXT_SWITCHES,
+  PERF_COUNTER_COUNT
+};
+
+inline const char *perfCounterName(uint32_t counter){
+  static const char *const names[PERF_COUNTER_COUNT] = {"cycles", "instructions", "LLC misses", "page faults", "context switches"};
+  return counter < PERF_COUNTER_COUNT ? names[counter] : "?";
+}
+
+// Sums over all copies of a swapchain. Only has atomics, so it can live in
+// shared memory as well.
+struct PerfTotals {
+  std::atomic<uint64_t> copies;
+  std::atomic<uint64_t> values[PERF_COUNTER_COUNT];
+};
+
+class PerfCounters {
+  int leader = -1;
+  // Every fd of the group, the leader first.
+  int fds[PERF_COUNTER_COUNT];
+  // Position of each counter in the group's read buffer, -1 if not open.
+  int slot[PERF_COUNTER_COUNT];
+  uint32_t open_count = 0;
+
+  static int open(uint32_t type, uint64_t config, int group){
+    perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.read_format = PERF_FORMAT_GROUP;
+    attr.exclude_hv = 1;
+    int fd = syscall(SYS_perf_event_open, &attr, 0, -1, group, PERF_FLAG_FD_CLOEXEC);
+    if(fd < 0 && (errno == EACCES || errno == EPERM)){
+      // perf_event_paranoid 2 still allows counting user space.
+      attr.exclude_kernel = 1;
+      fd = syscall(SYS_perf_event_open, &attr, 0, -1, group, PERF_FLAG_FD_CLOEXEC);
+    }
+    return fd;
+  }
+
+  PerfCounters(){
+    const struct { uint32_t type; uint64_t config; } events[PERF_COUNTER_COUNT] = {
+      {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+      {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+      {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+      {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS},
+      {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES},
+    };
+    for(uint32_t i = 0; i < PERF_COUNTER_COUNT; i++){
+      slot[i] = -1;
+      const int fd = open(events[i].type, events[i].config, leader);
+      if(fd < 0){
+        continue;
+      }
+      if(leader < 0){
+        leader = fd;
+      }
+      fds[open_count] = fd;
+      slot[i] = open_count++;
+    }
+  }
+  // The group's fds stay open for the lifetime of the thread.
+  ~PerfCounters(){
+    for(uint32_t i = 0; i < open_count; i++){
+      close(fds[i]);
+    }
+  }
+
+  bool read(uint64_t (&values)[PERF_COUNTER_COUNT]){
+    uint64_t buffer[1 + PERF_COUNTER_COUNT];
+    if(::read(leader, buffer, sizeof(buffer)) < ssize_t((1 + open_count) * sizeof(uint64_t))){
+      return false;
+    }
+    for(uint32_t i = 0; i < PERF_COUNTER_COUNT; i++){
+      values[i] = slot[i] < 0 ? 0 : buffer[1 + slot[i]];
+    }
+    return true;
+  }
+
+public:
+  PerfCounters(const PerfCounters &) = delete;
+
+  static const bool enabled;
+
+  // The calling thread's counters, nullptr if none could be opened.
+  static PerfCounters *forThread(){
+    thread_local PerfCounters counters;
+    return counters.leader >= 0 ? &counters : nullptr;
+  }
+
+  // Adds what the calling thread's counters advanced from its construction
+  // to its destruction to `totals`, if that is not nullptr.
+  class Scope {
+    PerfTotals *totals;
+    PerfCounters *counters = nullptr;
+    uint64_t start[PERF_COUNTER_COUNT];
+  public:
+    Scope(PerfTotals *totals): totals(totals){
+      if(totals != nullptr && enabled){
+        counters = forThread();
+        if(counters != nullptr && !counters->read(start)){
+          counters = nullptr;
+        }
+      }
+    }
+    Scope(const Scope &) = delete;
+    ~Scope(){
+      uint64_t end[PERF_COUNTER_COUNT];
+      if(counters != nullptr && counters->read(end)){
+        for(uint32_t i = 0; i < PERF_COUNTER_COUNT; i++){
+          totals->values[i].fetch_add(end[i] - start[i], std::memory_order_relaxed);
+        }
+      }
+    }
+  };
+};
+
+inline const bool PerfCounters::enabled = [](){
+  const char *env = getenv("PRIMUS_VK_PERF_COUNTERS");
+  return env != nullptr && std::string{env} == "1";
+}();
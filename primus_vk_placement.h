@@ -0,0 +1,214 @@
+#pragma once
+
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <dirent.h>
+#include <linux/mempolicy.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Where the layer's worker threads run and where its host memory lives.
+//
+// PRIMUS_VK_CPUS pins the copy and present threads, one core each in the
+// order the threads start, and makes host buffers the layer allocates
+// itself prefer the NUMA node of the first of these cores.
+// PRIMUS_VK_THREAD_PRIORITY raises them to SCHED_FIFO (`fifo` or
+// `fifo:<priority>`) or sets their nice value (a number). Every thread
+// counts how often it was found on a different core than for its last work
+// item.
+
+class ThreadPlacement {
+public:
+  struct Thread {
+    std::string name;
+    int pinned_cpu = -1;
+    std::string problem;
+    std::atomic<int> last_cpu{-1};
+    std::atomic<uint64_t> work_items{0};
+    std::atomic<uint64_t> migrations{0};
+
+    // Called by the thread itself before each work item.
+    void sample(){
+      const int cpu = sched_getcpu();
+      const int last = last_cpu.exchange(cpu, std::memory_order_relaxed);
+      if(last != -1 && last != cpu){
+        migrations.fetch_add(1, std::memory_order_relaxed);
+      }
+      work_items.fetch_add(1, std::memory_order_relaxed);
+    }
+  };
+
+private:
+  std::vector<int> cpus;
+  bool fifo = false;
+  int fifo_priority = 1;
+  bool set_nice = false;
+  int nice_value = 0;
+
+  std::mutex mutex;
+  // Never shrinks, so threads can keep pointers to their entries.
+  std::deque<Thread> threads;
+
+  // "0-3,8" -> {0, 1, 2, 3, 8}
+  static std::vector<int> parseCpuList(const std::string &list){
+    std::vector<int> result;
+    size_t pos = 0;
+    while(pos < list.size()){
+      size_t end = list.find(',', pos);
+      if(end == std::string::npos){
+        end = list.size();
+      }
+      const std::string item = list.substr(pos, end - pos);
+      const size_t dash = item.find('-');
+      if(!item.empty()){
+        const int first = std::stoi(item.substr(0, dash));
+        const int last = dash == std::string::npos ? first : std::stoi(item.substr(dash + 1));
+        for(int cpu = first; cpu <= last; cpu++){
+          result.push_back(cpu);
+        }
+      }
+      pos = end + 1;
+    }
+    return result;
+  }
+
+  void applyPriority(Thread &thread){
+    if(fifo){
+      sched_param param {};
+      param.sched_priority = fifo_priority;
+      const int err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+      if(err != 0){
+        thread.problem += std::string{"SCHED_FIFO: "} + strerror(err) + "; ";
+      }
+    }else if(set_nice){
+      if(setpriority(PRIO_PROCESS, syscall(SYS_gettid), nice_value) != 0){
+        thread.problem += std::string{"nice: "} + strerror(errno) + "; ";
+      }
+    }
+  }
+  void applyAffinity(Thread &thread){
+    if(thread.pinned_cpu < 0){
+      return;
+    }
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(thread.pinned_cpu, &set);
+    const int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if(err != 0){
+      thread.problem += std::string{"affinity: "} + strerror(err) + "; ";
+      thread.pinned_cpu = -1;
+    }
+  }
+
+public:
+  ThreadPlacement(){
+    const char *cpus_env = getenv("PRIMUS_VK_CPUS");
+    if(cpus_env != nullptr){
+      cpus = parseCpuList(cpus_env);
+    }
+    const char *prio_env = getenv("PRIMUS_VK_THREAD_PRIORITY");
+    if(prio_env != nullptr){
+      const std::string prio{prio_env};
+      if(prio.compare(0, 4, "fifo") == 0){
+        fifo = true;
+        if(prio.size() > 5 && prio[4] == ':'){
+          fifo_priority = std::stoi(prio.substr(5));
+        }
+      }else if(!prio.empty()){
+        set_nice = true;
+        nice_value = std::stoi(prio);
+      }
+    }
+  }
+  ThreadPlacement(const ThreadPlacement &) = delete;
+
+  // Registers the calling thread and applies affinity and priority to it.
+  Thread &enter(const char *name){
+    std::unique_lock<std::mutex> lock(mutex);
+    threads.emplace_back();
+    Thread &thread = threads.back();
+    thread.name = name;
+    // Names the thread in traces and debuggers.
+    pthread_setname_np(pthread_self(), name);
+    if(!cpus.empty()){
+      thread.pinned_cpu = cpus[(threads.size() - 1) % cpus.size()];
+    }
+    applyAffinity(thread);
+    applyPriority(thread);
+    return thread;
+  }
+
+  void forEachThread(const std::function<void(const Thread &)> &fn){
+    std::unique_lock<std::mutex> lock(mutex);
+    for(auto &thread: threads){
+      fn(thread);
+    }
+  }
+
+  // NUMA node of the first pinned core, -1 if nothing is pinned or the
+  // kernel does not tell.
+  int preferredNode() const {
+    if(cpus.empty()){
+      return -1;
+    }
+    const std::string path = "/sys/devices/system/cpu/cpu" + std::to_string(cpus[0]);
+    DIR *dir = opendir(path.c_str());
+    if(dir == nullptr){
+      return -1;
+    }
+    int node = -1;
+    while(dirent *entry = readdir(dir)){
+      if(strncmp(entry->d_name, "node", 4) == 0 && entry->d_name[4] >= '0' && entry->d_name[4] <= '9'){
+        node = atoi(entry->d_name + 4);
+        break;
+      }
+    }
+    closedir(dir);
+    return node;
+  }
+
+  static ThreadPlacement &shared(){
+    static ThreadPlacement placement;
+    return placement;
+  }
+};
+
+// Faults in every page of a host range that is about to be used for
+// frames and locks it, so the first frames do not pay for page faults and
+// the pages are not reclaimed later. With `node` >= 0 memory that is not
+// populated yet prefers that NUMA node. Returns false if the pages could
+// not be locked; they are still faulted in.
+inline bool prepareHostPages(void *data, size_t size, int node = -1){
+  const size_t page = sysconf(_SC_PAGESIZE);
+  char *first = static_cast<char*>(data);
+  char *begin = reinterpret_cast<char*>(reinterpret_cast<uintptr_t>(data) / page * page);
+  const size_t length = first + size - begin;
+  if(node >= 0 && node < 64){
+    const unsigned long mask = 1ul << node;
+    syscall(SYS_mbind, begin, length, MPOL_PREFERRED, &mask, 64, 0);
+  }
+  for(char *p = begin; p < first + size; p += page){
+    volatile char *byte = p < first ? first : p;
+    *byte = *byte;
+  }
+  return mlock(begin, length) == 0;
+}
+
+inline void releaseHostPages(void *data, size_t size){
+  const size_t page = sysconf(_SC_PAGESIZE);
+  char *begin = reinterpret_cast<char*>(reinterpret_cast<uintptr_t>(data) / page * page);
+  munlock(begin, static_cast<char*>(data) + size - begin);
+}
@@ -0,0 +1,322 @@
+#pragma once
+
+#include "primus_vk_placement.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <cstdint>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <linux/futex.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Hands presented frames from the application thread to the present threads
+// without locks or allocations.
+//
+// push() copies the item into the next slot and publishes it by bumping the
+// slot's sequence number; present threads claim slots with a CAS on the
+// read position. Frames have to leave in push order, so every frame gets a
+// ticket: awaitTurn(t) sleeps on the turn word of the frame's own slot, and
+// finish(t) hands the turn to the slot of t + 1 only, which wakes exactly the
+// thread holding the next frame.
+
+// A 32 bit word threads can sleep on until it changes. The waiter count
+// keeps the syscall out of publish() while nobody sleeps.
+struct FutexWord {
+  std::atomic<uint32_t> value{0};
+  std::atomic<uint32_t> waiters{0};
+
+  void waitChange(uint32_t seen){
+    waiters.fetch_add(1);
+    if(value.load() == seen){
+      syscall(SYS_futex, reinterpret_cast<uint32_t*>(&value), FUTEX_WAIT_PRIVATE, seen, nullptr, nullptr, 0);
+    }
+    waiters.fetch_sub(1);
+  }
+  void publish(uint32_t v, int wake = INT_MAX){
+    value.store(v);
+    if(waiters.load() != 0){
+      syscall(SYS_futex, reinterpret_cast<uint32_t*>(&value), FUTEX_WAKE_PRIVATE, wake, nullptr, nullptr, 0);
+    }
+  }
+  void bump(int wake = INT_MAX){
+    value.fetch_add(1);
+    if(waiters.load() != 0){
+      syscall(SYS_futex, reinterpret_cast<uint32_t*>(&value), FUTEX_WAKE_PRIVATE, wake, nullptr, nullptr, 0);
+    }
+  }
+};
+
+template<typename T>
+class PresentRing {
+  struct alignas(64) Slot {
+    // Ticket + 1 once the item for ticket was pushed, ticket + capacity once
+    // it was claimed and the slot can take the next lap's item.
+    FutexWord sequence;
+    // Equals the ticket whose turn it is to finish.
+    FutexWord turn;
+    T item;
+  };
+  const uint32_t mask;
+  std::unique_ptr<Slot[]> slots;
+  // Next ticket to push, to claim and to finish.
+  alignas(64) std::atomic<uint32_t> head{0};
+  alignas(64) std::atomic<uint32_t> tail{0};
+  alignas(64) FutexWord done;
+
+  static uint32_t roundUp(uint32_t n){
+    uint32_t capacity = 2;
+    while(capacity < n){
+      capacity *= 2;
+    }
+    return capacity;
+  }
+public:
+  PresentRing(uint32_t capacity): mask(roundUp(capacity) - 1), slots(new Slot[mask + 1]){
+    for(uint32_t i = 0; i <= mask; i++){
+      slots[i].sequence.value = i;
+      // Never equal to a ticket of this slot before finish() sets it.
+      slots[i].turn.value = i == 0 ? 0 : i - 1;
+    }
+  }
+
+  // Single producer.
+  void push(const T &item){
+    const uint32_t pos = head.load(std::memory_order_relaxed);
+    Slot &slot = slots[pos & mask];
+    for(uint32_t seq = slot.sequence.value.load(); seq != pos; seq = slot.sequence.value.load()){
+      slot.sequence.waitChange(seq);
+    }
+    slot.item = item;
+    slot.sequence.publish(pos + 1);
+    head.store(pos + 1);
+  }
+
+  // Returns false if no item is waiting to be claimed.
+  bool tryClaim(T &item, uint32_t &ticket){
+    while(true){
+      uint32_t pos = tail.load();
+      Slot &slot = slots[pos & mask];
+      if(slot.sequence.value.load() != pos + 1){
+        return false;
+      }
+      if(tail.compare_exchange_weak(pos, pos + 1)){
+        item = slot.item;
+        ticket = pos;
+        slot.sequence.publish(pos + mask + 1);
+        return true;
+      }
+    }
+  }
+  // Pushed but not yet claimed items.
+  uint32_t backlog() const {
+    return head.load() - tail.load();
+  }
+  // Claimed but not yet finished items.
+  uint32_t inProgress() const {
+    return tail.load() - done.value.load();
+  }
+  // True once an item was pushed after the one holding `ticket`.
+  bool hasNewer(uint32_t ticket) const {
+    return head.load() - ticket > 1;
+  }
+
+  void awaitTurn(uint32_t ticket){
+    Slot &slot = slots[ticket & mask];
+    for(uint32_t turn = slot.turn.value.load(); turn != ticket; turn = slot.turn.value.load()){
+      slot.turn.waitChange(turn);
+    }
+  }
+  void finish(uint32_t ticket){
+    // `done` first: once the turn moves on, the next thread may publish its
+    // own value before this one.
+    done.publish(ticket + 1);
+    slots[(ticket + 1) & mask].turn.publish(ticket + 1);
+  }
+
+  // Blocks until the item with `ticket` and all before it are finished.
+  void awaitFinished(uint32_t ticket){
+    for(uint32_t finished = done.value.load(); int32_t(finished - ticket) <= 0; finished = done.value.load()){
+      done.waitChange(finished);
+    }
+  }
+  // Blocks while more than `limit` pushed items are not finished.
+  void waitPending(uint32_t limit){
+    for(uint32_t finished = done.value.load(); head.load() - finished > limit; finished = done.value.load()){
+      done.waitChange(finished);
+    }
+  }
+
+};
+
+// Something with frames for the present threads, one per swapchain.
+struct PresentSource {
+  virtual ~PresentSource() = default;
+  // Claims and presents one frame; false if none was queued.
+  virtual bool presentNext() = 0;
+  virtual uint32_t backlog() = 0;
+};
+
+// The layer-wide present threads, shared by all swapchains so creating and
+// destroying swapchains does not start or join threads. Every thread serves
+// every swapchain; the order in which frames of one swapchain reach the
+// display is kept by its PresentRing.
+//
+// Fair scheduling goes round-robin over the swapchains, backlog scheduling
+// serves the swapchain with the most queued frames first.
+//
+// A thread that claimed a frame stays with it until the frame is shown, which
+// can take long when the display stalls. At most max_per_source threads work
+// on one swapchain at a time, so a stalled swapchain cannot hold all threads
+// while the others still get two frames in flight.
+class PresentExecutor {
+  static constexpr uint32_t max_per_source = 2;
+
+  struct Entry {
+    PresentSource *source;
+    std::atomic<uint32_t> running{0};
+    std::atomic<bool> removed{false};
+    Entry(PresentSource *source): source(source) {}
+  };
+  using EntryList = std::vector<std::shared_ptr<Entry>>;
+
+  // Only taken to add and remove sources.
+  std::mutex mutex;
+  std::shared_ptr<const EntryList> entries = std::make_shared<const EntryList>();
+  FutexWord work;
+  std::atomic<bool> stopping{false};
+  std::atomic<uint32_t> cursor{0};
+  const bool backlog_first;
+  std::vector<std::thread> threads;
+
+  bool tryRun(Entry &entry){
+    uint32_t running = entry.running.load();
+    do {
+      if(running >= max_per_source){
+        return false;
+      }
+    } while(!entry.running.compare_exchange_weak(running, running + 1));
+    bool ran = false;
+    if(!entry.removed.load()){
+      ran = entry.source->presentNext();
+    }
+    entry.running.fetch_sub(1);
+    return ran;
+  }
+  bool runOne(const EntryList &list){
+    if(list.empty()){
+      return false;
+    }
+    if(backlog_first){
+      Entry *busiest = nullptr;
+      uint32_t most = 0;
+      for(auto &entry: list){
+        const uint32_t backlog = entry->source->backlog();
+        if(backlog > most){
+          most = backlog;
+          busiest = entry.get();
+        }
+      }
+      if(busiest != nullptr && tryRun(*busiest)){
+        return true;
+      }
+    }
+    const size_t start = cursor.fetch_add(1);
+    for(size_t i = 0; i < list.size(); i++){
+      if(tryRun(*list[(start + i) % list.size()])){
+        return true;
+      }
+    }
+    return false;
+  }
+  void run(){
+    ThreadPlacement::Thread &placement = ThreadPlacement::shared().enter("present-thread");
+    while(!stopping.load()){
+      const uint32_t seen = work.value.load();
+      auto list = std::atomic_load(&entries);
+      placement.sample();
+      if(!runOne(*list)){
+        work.waitChange(seen);
+      }
+    }
+  }
+public:
+  using Handle = std::shared_ptr<Entry>;
+
+  PresentExecutor(size_t threadCount, bool backlogFirst): backlog_first(backlogFirst){
+    threads.reserve(threadCount);
+    for(size_t i = 0; i < threadCount; i++){
+      threads.emplace_back([this](){ this->run(); });
+      pthread_setname_np(threads.back().native_handle(), "present-thread");
+    }
+  }
+  PresentExecutor(const PresentExecutor &) = delete;
+  ~PresentExecutor(){
+    stopping.store(true);
+    work.bump();
+    for(auto &thread: threads){
+      thread.join();
+    }
+  }
+  size_t threadCount() const {
+    return threads.size();
+  }
+
+  Handle add(PresentSource *source){
+    auto entry = std::make_shared<Entry>(source);
+    std::unique_lock<std::mutex> lock(mutex);
+    auto list = std::make_shared<EntryList>(*entries);
+    list->push_back(entry);
+    std::atomic_store(&entries, std::shared_ptr<const EntryList>(list));
+    return entry;
+  }
+  // Returns once no present thread is inside the source any more. Frames
+  // that were queued but not claimed yet are dropped.
+  void remove(const Handle &entry){
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      auto list = std::make_shared<EntryList>(*entries);
+      list->erase(std::remove(list->begin(), list->end(), entry), list->end());
+      std::atomic_store(&entries, std::shared_ptr<const EntryList>(list));
+    }
+    entry->removed.store(true);
+    while(entry->running.load() != 0){
+      std::this_thread::sleep_for(std::chrono::microseconds(100));
+    }
+  }
+  // A frame was pushed to one of the sources.
+  void notify(){
+    work.bump(1);
+  }
+
+  // PRIMUS_VK_PRESENT_THREADS sets the number of threads (default 4,
+  // PRIMUS_VK_MULTITHREADING=1 still means one), PRIMUS_VK_PRESENT_SCHEDULING
+  // is `fair` (default) or `backlog`.
+  static PresentExecutor &shared(){
+    static PresentExecutor executor{[](){
+      size_t threads = 4;
+      const char *multi_env = getenv("PRIMUS_VK_MULTITHREADING");
+      if(multi_env != nullptr && std::string{multi_env} == "1"){
+        threads = 1;
+      }
+      const char *env = getenv("PRIMUS_VK_PRESENT_THREADS");
+      if(env != nullptr){
+        threads = std::max(1, std::stoi(std::string{env}));
+      }
+      return threads;
+    }(), [](){
+      const char *env = getenv("PRIMUS_VK_PRESENT_SCHEDULING");
+      return env != nullptr && std::string{env} == "backlog";
+    }()};
+    return executor;
+  }
+};
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <memory>
+
+// Staging resources a recreated swapchain takes over from the same image of
+// the old swapchain, so a window drag does not allocate and fault in new
+// memory for every size it passes. Only resources the layer alone uses are
+// taken over; the images the application renders to stay with the old
+// swapchain until it is destroyed.
+
+// What the donor used, or its own spare if it never got prepared.
+template<typename T>
+std::shared_ptr<T> takeFromDonor(std::shared_ptr<T> &used, std::shared_ptr<T> &spare){
+  return used ? std::move(used) : std::move(spare);
+}
+
+// Moves `spare` to `mine` if `fits` accepts it. Returns whether `mine` is
+// set, so callers only create what could not be taken over.
+template<typename T, typename Fits>
+bool takeSpare(std::shared_ptr<T> &mine, std::shared_ptr<T> &spare, Fits fits){
+  if(spare && fits(*spare)){
+    mine = std::move(spare);
+  }
+  return mine != nullptr;
+}
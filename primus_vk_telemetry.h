@@ -0,0 +1,218 @@
+#pragma once
+
+#include "primus_vk_perf.h"
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <new>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// Live statistics of every swapchain of a process, kept in the shared
+// memory segment /dev/shm/primus_vk.<pid> for pvkstat to read while the
+// application runs.
+//
+// PRIMUS_VK_TELEMETRY=1 creates the segment. Each swapchain takes one slot
+// of it and updates counters and latency histograms with relaxed atomic
+// adds, never waiting for the reader. The histograms are log-linear like
+// HdrHistogram: 16 buckets per power of two, so a percentile read from them
+// is within about 6% of the real value.
+
+namespace telemetry {
+
+constexpr uint32_t magic = 0x4b565050; // "PPVK"
+constexpr uint32_t version = 4;
+constexpr uint32_t max_swapchains = 8;
+
+enum Stage {
+  // Application waiting in vkAcquireNextImageKHR for a free image, without
+  // the frame rate limit.
+  STAGE_ACQUIRE,
+  // Present thread waiting for the render GPU's readback of the frame.
+  STAGE_READBACK,
+  // Host copy from the render GPU's memory to the display GPU's.
+  STAGE_MEMCPY,
+  // Waiting for an image of the display swapchain.
+  STAGE_DISPLAY_ACQUIRE,
+  // vkQueuePresentKHR on the display GPU.
+  STAGE_PRESENT,
+  // From vkQueuePresentKHR of the application to the display's.
+  STAGE_LATENCY,
+  // GPU time of the readback on the render GPU and of the upload on the
+  // display GPU, with PRIMUS_VK_GPU_TIMESTAMPS.
+  STAGE_READBACK_GPU,
+  STAGE_UPLOAD_GPU,
+  STAGE_COUNT
+};
+
+inline const char *stageName(uint32_t stage){
+  static const char *const names[STAGE_COUNT] = {"acquire", "readback", "memcpy", "display acquire", "present", "latency", "readback (GPU)", "upload (GPU)"};
+  return stage < STAGE_COUNT ? names[stage] : "?";
+}
+
+// Durations in nanoseconds, up to 2^40 (18 minutes).
+struct Histogram {
+  static constexpr uint32_t sub_bits = 4;
+  static constexpr uint32_t sub_count = 1 << sub_bits;
+  static constexpr uint32_t max_exponent = 39;
+  static constexpr uint32_t bucket_count = (max_exponent - sub_bits + 2) * sub_count;
+
+  std::atomic<uint64_t> counts[bucket_count];
+  std::atomic<uint64_t> total;
+
+  static uint32_t bucketOf(uint64_t value){
+    value = value < (uint64_t{1} << (max_exponent + 1)) ? value : (uint64_t{1} << (max_exponent + 1)) - 1;
+    if(value < sub_count){
+      return value;
+    }
+    const uint32_t exponent = 63 - __builtin_clzll(value);
+    return (exponent - sub_bits + 1) * sub_count + ((value >> (exponent - sub_bits)) & (sub_count - 1));
+  }
+  // Smallest value that falls into `bucket`.
+  static uint64_t bucketStart(uint32_t bucket){
+    if(bucket < sub_count){
+      return bucket;
+    }
+    const uint32_t exponent = bucket / sub_count + sub_bits - 1;
+    return (uint64_t{sub_count} + bucket % sub_count) << (exponent - sub_bits);
+  }
+
+  void record(uint64_t value){
+    counts[bucketOf(value)].fetch_add(1, std::memory_order_relaxed);
+    total.fetch_add(1, std::memory_order_relaxed);
+  }
+};
+
+struct alignas(64) SwapchainStats {
+  // Odd while a swapchain owns the slot; a new owner makes it odd again
+  // with a higher value, so readers notice the counters were reset.
+  std::atomic<uint32_t> generation;
+  std::atomic<uint32_t> width;
+  std::atomic<uint32_t> height;
+  std::atomic<uint64_t> presented;
+  std::atomic<uint64_t> dropped;
+  std::atomic<uint64_t> bytes_copied;
+  // Bytes the dirty tiles saved the host copy, with PRIMUS_VK_DIRTY_TILES.
+  std::atomic<uint64_t> bytes_skipped;
+  // Frames queued and not claimed by a present thread yet, and frames a
+  // present thread works on; sampled when a frame is presented.
+  std::atomic<uint32_t> queued;
+  std::atomic<uint32_t> in_progress;
+  Histogram stages[STAGE_COUNT];
+  // With PRIMUS_VK_PERF_COUNTERS, updated once per presented frame.
+  PerfTotals copy_counters;
+
+  bool active() const {
+    return generation.load() % 2 == 1;
+  }
+};
+
+struct Segment {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t pid;
+  uint32_t swapchain_count;
+  SwapchainStats swapchains[max_swapchains];
+};
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "shared counters need lock-free atomics");
+
+inline std::string segmentName(int pid){
+  return "/primus_vk." + std::to_string(pid);
+}
+
+// The writing side, owned by the layer.
+class Publisher {
+  Segment *segment = nullptr;
+  std::string name;
+  std::mutex mutex;
+
+  Publisher(){
+    const char *env = getenv("PRIMUS_VK_TELEMETRY");
+    if(env == nullptr || std::string{env} != "1"){
+      return;
+    }
+    name = segmentName(getpid());
+    const int fd = shm_open(name.c_str(), O_CREAT | O_RDWR | O_TRUNC, 0600);
+    if(fd < 0 || ftruncate(fd, sizeof(Segment)) != 0){
+      fprintf(stderr, "PrimusVK: Cannot create telemetry segment %s\n", name.c_str());
+      if(fd >= 0){
+        close(fd);
+        shm_unlink(name.c_str());
+      }
+      return;
+    }
+    void *data = mmap(nullptr, sizeof(Segment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(data == MAP_FAILED){
+      shm_unlink(name.c_str());
+      return;
+    }
+    segment = new (data) Segment{};
+    segment->pid = getpid();
+    segment->version = version;
+    segment->swapchain_count = max_swapchains;
+    std::atomic_thread_fence(std::memory_order_release);
+    segment->magic = magic;
+    atexit([](){ shm_unlink(Publisher::shared().name.c_str()); });
+  }
+
+public:
+  Publisher(const Publisher &) = delete;
+
+  // Never destroyed, like the tracer: present threads may still publish
+  // while the process exits.
+  static Publisher &shared(){
+    static Publisher *publisher = new Publisher;
+    return *publisher;
+  }
+
+  // A zeroed slot for a new swapchain, nullptr if telemetry is off or all
+  // slots are taken.
+  SwapchainStats *claim(uint32_t width, uint32_t height){
+    if(segment == nullptr){
+      return nullptr;
+    }
+    std::unique_lock<std::mutex> lock(mutex);
+    for(auto &stats: segment->swapchains){
+      if(stats.active()){
+        continue;
+      }
+      stats.presented = 0;
+      stats.dropped = 0;
+      stats.bytes_copied = 0;
+      stats.bytes_skipped = 0;
+      stats.queued = 0;
+      stats.in_progress = 0;
+      stats.copy_counters.copies = 0;
+      for(auto &value: stats.copy_counters.values){
+        value = 0;
+      }
+      for(auto &histogram: stats.stages){
+        for(auto &count: histogram.counts){
+          count.store(0, std::memory_order_relaxed);
+        }
+        histogram.total = 0;
+      }
+      stats.width = width;
+      stats.height = height;
+      stats.generation.fetch_add(1);
+      return &stats;
+    }
+    return nullptr;
+  }
+  void release(SwapchainStats *stats){
+    if(stats != nullptr){
+      std::unique_lock<std::mutex> lock(mutex);
+      stats->generation.fetch_add(1);
+    }
+  }
+};
+
+} // namespace telemetry
@@ -0,0 +1,210 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+// Per-frame event tracer, written as a Chrome Trace Event file that
+// chrome://tracing and ui.perfetto.dev open offline.
+//
+// PRIMUS_VK_TRACE=<file> switches it on; `%p` in the name is replaced by
+// the process id. Without it every trace point is one branch on a constant
+// flag. Each thread records into its own ring buffer, which only that
+// thread writes, so recording takes no lock. The ring keeps the last
+// event_capacity events of each thread. write() exports all rings and is
+// called when a swapchain is destroyed and at exit; events recorded while
+// it runs may be missing from the file. Every slot carries the number of
+// the event it holds, zero while it is being written, so write() skips
+// slots it would read half-written.
+
+class Tracer {
+public:
+  struct Event {
+    const char *name;
+    uint64_t start;
+    uint64_t duration;
+    int64_t image;
+    // Chrome trace phase: 'X' span, 'i' instant.
+    char phase;
+  };
+
+private:
+  static constexpr uint32_t event_capacity = 1 << 16;
+
+  // The fields are atomics only so write() may read them while the owning
+  // thread writes; `sequence` decides whether what it read is usable.
+  struct Slot {
+    std::atomic<uint64_t> sequence{0};
+    std::atomic<const char*> name;
+    std::atomic<uint64_t> start;
+    std::atomic<uint64_t> duration;
+    std::atomic<int64_t> image;
+    std::atomic<char> phase;
+  };
+  struct Ring {
+    std::unique_ptr<Slot[]> events{new Slot[event_capacity]};
+    std::atomic<uint64_t> head{0};
+    long tid;
+    std::string name;
+  };
+
+  std::string path;
+  std::mutex mutex;
+  // Rings outlive their threads so write() can still export them.
+  std::deque<Ring> rings;
+
+  Tracer(){
+    const char *env = getenv("PRIMUS_VK_TRACE");
+    if(env == nullptr || *env == 0){
+      return;
+    }
+    path = env;
+    const size_t pid = path.find("%p");
+    if(pid != std::string::npos){
+      path.replace(pid, 2, std::to_string(getpid()));
+    }
+    atexit([](){ Tracer::shared().write(); });
+  }
+
+  // False if the slot does not hold event `sequence` from start to end of
+  // the read, it was overwritten or is being written.
+  static bool read(const Slot &slot, uint64_t sequence, Event &e){
+    if(slot.sequence.load(std::memory_order_acquire) != sequence){
+      return false;
+    }
+    e.name = slot.name.load(std::memory_order_relaxed);
+    e.start = slot.start.load(std::memory_order_relaxed);
+    e.duration = slot.duration.load(std::memory_order_relaxed);
+    e.image = slot.image.load(std::memory_order_relaxed);
+    e.phase = slot.phase.load(std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return slot.sequence.load(std::memory_order_relaxed) == sequence;
+  }
+
+  Ring &ring(){
+    thread_local Ring *mine = nullptr;
+    if(mine == nullptr){
+      std::unique_lock<std::mutex> lock(mutex);
+      rings.emplace_back();
+      mine = &rings.back();
+      mine->tid = syscall(SYS_gettid);
+      char name[16] = {};
+      pthread_getname_np(pthread_self(), name, sizeof(name));
+      mine->name = name;
+    }
+    return *mine;
+  }
+
+public:
+  Tracer(const Tracer &) = delete;
+
+  static Tracer &shared(){
+    // Never destroyed: the exit handler and threads still running at exit
+    // use it after static destructors.
+    static Tracer *tracer = new Tracer;
+    return *tracer;
+  }
+  // Read once, the trace points only test this.
+  static const bool enabled;
+
+  static uint64_t now(){
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return uint64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+  }
+
+  // `name` must be a string literal. `image` is -1 for events that do not
+  // belong to one image.
+  void record(char phase, const char *name, int64_t image, uint64_t start, uint64_t duration = 0){
+    Ring &r = ring();
+    const uint64_t head = r.head.load(std::memory_order_relaxed);
+    Slot &slot = r.events[head % event_capacity];
+    slot.sequence.store(0, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    slot.name.store(name, std::memory_order_relaxed);
+    slot.start.store(start, std::memory_order_relaxed);
+    slot.duration.store(duration, std::memory_order_relaxed);
+    slot.image.store(image, std::memory_order_relaxed);
+    slot.phase.store(phase, std::memory_order_relaxed);
+    slot.sequence.store(head + 1, std::memory_order_release);
+    r.head.store(head + 1, std::memory_order_release);
+  }
+
+  void write(){
+    if(path.empty()){
+      return;
+    }
+    std::unique_lock<std::mutex> lock(mutex);
+    FILE *out = fopen(path.c_str(), "w");
+    if(out == nullptr){
+      fprintf(stderr, "PrimusVK: Cannot write trace to %s\n", path.c_str());
+      return;
+    }
+    const int pid = getpid();
+    fprintf(out, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    fprintf(out, "{\"ph\":\"M\",\"name\":\"process_name\",\"pid\":%d,\"args\":{\"name\":\"PrimusVK\"}}", pid);
+    for(auto &r: rings){
+      fprintf(out, ",\n{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":%d,\"tid\":%ld,\"args\":{\"name\":\"%s\"}}", pid, r.tid, r.name.c_str());
+      const uint64_t head = r.head.load(std::memory_order_acquire);
+      for(uint64_t i = head > event_capacity ? head - event_capacity : 0; i < head; i++){
+        Event e;
+        if(!read(r.events[i % event_capacity], i + 1, e)){
+          continue;
+        }
+        fprintf(out, ",\n{\"ph\":\"%c\",\"name\":\"%s\",\"pid\":%d,\"tid\":%ld,\"ts\":%.3f", e.phase, e.name, pid, r.tid, e.start / 1e3);
+        if(e.phase == 'X'){
+          fprintf(out, ",\"dur\":%.3f", e.duration / 1e3);
+        }else{
+          fprintf(out, ",\"s\":\"t\"");
+        }
+        if(e.image >= 0){
+          fprintf(out, ",\"args\":{\"image\":%lld}", static_cast<long long>(e.image));
+        }
+        fprintf(out, "}");
+      }
+    }
+    fprintf(out, "\n]}\n");
+    fclose(out);
+  }
+};
+
+inline const bool Tracer::enabled = [](){
+  const char *env = getenv("PRIMUS_VK_TRACE");
+  return env != nullptr && *env != 0;
+}();
+
+// Records the time from its construction to the end of the scope as one
+// span.
+class TraceScope {
+  const char *name;
+  int64_t image;
+  uint64_t start = 0;
+public:
+  TraceScope(const char *name, int64_t image): name(name), image(image){
+    if(__builtin_expect(Tracer::enabled, 0)){
+      start = Tracer::now();
+    }
+  }
+  TraceScope(const TraceScope &) = delete;
+  ~TraceScope(){
+    if(__builtin_expect(Tracer::enabled, 0)){
+      Tracer::shared().record('X', name, image, start, Tracer::now() - start);
+    }
+  }
+};
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+// A span named `name` (a string literal) from here to the end of the scope.
+#define TRACE_SCOPE(name, image) TraceScope TRACE_CONCAT(trace_scope_, __LINE__)(name, image)
+#define TRACE_INSTANT(name, image) do{ if(__builtin_expect(Tracer::enabled, 0)){ Tracer::shared().record('i', name, image, Tracer::now()); } }while(0)
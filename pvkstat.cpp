@@ -0,0 +1,209 @@
+#include "primus_vk_telemetry.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <dirent.h>
+#include <signal.h>
+
+// Shows the live statistics of an application running with
+// PRIMUS_VK_TELEMETRY=1: frame rates, copy bandwidth, queue depth and the
+// latency percentiles of each stage over the last interval. Only reads the
+// shared memory segment, the application is not slowed down.
+
+using namespace telemetry;
+
+const auto self = std::string{"pvkstat: "};
+
+// Copy of one slot, taken once per interval.
+struct Snapshot {
+  uint32_t generation = 0;
+  uint64_t presented = 0;
+  uint64_t dropped = 0;
+  uint64_t bytes_copied = 0;
+  uint64_t bytes_skipped = 0;
+  uint64_t copies = 0;
+  uint64_t copy_counters[PERF_COUNTER_COUNT] = {};
+  std::vector<std::vector<uint64_t>> counts;
+
+  void take(const SwapchainStats &stats){
+    generation = stats.generation.load();
+    presented = stats.presented.load();
+    dropped = stats.dropped.load();
+    bytes_copied = stats.bytes_copied.load();
+    bytes_skipped = stats.bytes_skipped.load();
+    copies = stats.copy_counters.copies.load();
+    for(uint32_t i = 0; i < PERF_COUNTER_COUNT; i++){
+      copy_counters[i] = stats.copy_counters.values[i].load();
+    }
+    counts.assign(STAGE_COUNT, std::vector<uint64_t>(Histogram::bucket_count));
+    for(uint32_t stage = 0; stage < STAGE_COUNT; stage++){
+      for(uint32_t bucket = 0; bucket < Histogram::bucket_count; bucket++){
+        counts[stage][bucket] = stats.stages[stage].counts[bucket].load(std::memory_order_relaxed);
+      }
+    }
+  }
+};
+
+// Value at quantile `q` of the samples between two snapshots, in ms; the
+// middle of its bucket.
+double percentile(const std::vector<uint64_t> &now, const std::vector<uint64_t> &before, uint64_t total, double q){
+  const uint64_t rank = std::max<uint64_t>(1, uint64_t(q * total + 0.5));
+  uint64_t seen = 0;
+  for(uint32_t bucket = 0; bucket < Histogram::bucket_count; bucket++){
+    seen += now[bucket] - before[bucket];
+    if(seen >= rank){
+      const uint64_t start = Histogram::bucketStart(bucket);
+      const uint64_t end = bucket + 1 < Histogram::bucket_count ? Histogram::bucketStart(bucket + 1) : start;
+      return (start + end) / 2 / 1e6;
+    }
+  }
+  return 0;
+}
+
+std::vector<int> findProcesses(){
+  std::vector<int> pids;
+  DIR *dir = opendir("/dev/shm");
+  if(dir == nullptr){
+    return pids;
+  }
+  while(dirent *entry = readdir(dir)){
+    if(strncmp(entry->d_name, "primus_vk.", 10) == 0){
+      const int pid = atoi(entry->d_name + 10);
+      // Segments of processes that crashed stay behind.
+      if(pid > 0 && kill(pid, 0) == 0){
+        pids.push_back(pid);
+      }
+    }
+  }
+  closedir(dir);
+  return pids;
+}
+
+const Segment *attach(int pid){
+  const std::string name = segmentName(pid);
+  const int fd = shm_open(name.c_str(), O_RDONLY, 0);
+  if(fd < 0){
+    std::cerr << self << "no telemetry for process " << pid << ", is PRIMUS_VK_TELEMETRY=1 set?" << std::endl;
+    return nullptr;
+  }
+  void *data = mmap(nullptr, sizeof(Segment), PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if(data == MAP_FAILED){
+    std::cerr << self << "cannot map " << name << std::endl;
+    return nullptr;
+  }
+  const Segment *segment = static_cast<const Segment*>(data);
+  if(segment->magic != magic || segment->version != version){
+    std::cerr << self << name << " was written by a different version of primus_vk" << std::endl;
+    return nullptr;
+  }
+  return segment;
+}
+
+int main(int argc, char **argv){
+  int pid = 0;
+  double interval = 1;
+  for(int i = 1; i < argc; i++){
+    std::string arg = argv[i];
+    if(arg == "-i" && i + 1 < argc){
+      interval = std::stod(argv[++i]);
+    }else if(pid == 0 && !arg.empty() && arg[0] != '-'){
+      pid = std::stoi(arg);
+    }else{
+      std::cerr << "usage: " << argv[0] << " [-i seconds] [pid]" << std::endl;
+      return 1;
+    }
+  }
+  if(pid == 0){
+    const auto pids = findProcesses();
+    if(pids.size() != 1){
+      std::cerr << self << (pids.empty() ? "no process with PRIMUS_VK_TELEMETRY=1 found" : "several processes found, pick one:");
+      for(int found: pids){
+        std::cerr << " " << found;
+      }
+      std::cerr << std::endl;
+      return 1;
+    }
+    pid = pids[0];
+  }
+  const Segment *segment = attach(pid);
+  if(segment == nullptr){
+    return 1;
+  }
+
+  std::vector<Snapshot> last(max_swapchains);
+  for(uint32_t slot = 0; slot < max_swapchains; slot++){
+    last[slot].take(segment->swapchains[slot]);
+  }
+  std::cout << std::fixed;
+  while(kill(pid, 0) == 0){
+    std::this_thread::sleep_for(std::chrono::duration<double>(interval));
+    for(uint32_t slot = 0; slot < max_swapchains; slot++){
+      const SwapchainStats &stats = segment->swapchains[slot];
+      Snapshot now;
+      now.take(stats);
+      Snapshot &before = last[slot];
+      if(now.generation != before.generation){
+        // A new swapchain, its counters started from zero.
+        before = Snapshot{};
+        before.generation = now.generation;
+        before.counts.assign(STAGE_COUNT, std::vector<uint64_t>(Histogram::bucket_count));
+      }
+      if(now.generation % 2 == 0){
+        before = now;
+        continue;
+      }
+      std::cout << "swapchain " << slot << " " << stats.width.load() << "x" << stats.height.load() << ": "
+                << std::setprecision(1)
+                << (now.presented - before.presented) / interval << " fps, "
+                << (now.dropped - before.dropped) / interval << " dropped/s, "
+                << (now.bytes_copied - before.bytes_copied) / interval / 1e6 << " MB/s copied, "
+                << (now.bytes_skipped - before.bytes_skipped) / interval / 1e6 << " MB/s skipped, "
+                << stats.queued.load() << " queued, " << stats.in_progress.load() << " in progress" << std::endl;
+      std::cout << "  " << std::left << std::setw(16) << "stage (ms)" << std::right
+                << std::setw(8) << "count" << std::setw(9) << "p50" << std::setw(9) << "p90"
+                << std::setw(9) << "p99" << std::setw(9) << "max" << std::endl;
+      for(uint32_t stage = 0; stage < STAGE_COUNT; stage++){
+        uint64_t total = 0;
+        for(uint32_t bucket = 0; bucket < Histogram::bucket_count; bucket++){
+          total += now.counts[stage][bucket] - before.counts[stage][bucket];
+        }
+        if(total == 0){
+          continue;
+        }
+        std::cout << "  " << std::left << std::setw(16) << stageName(stage) << std::right
+                  << std::setw(8) << total << std::setprecision(3);
+        for(double q: {0.5, 0.9, 0.99, 1.0}){
+          std::cout << std::setw(9) << percentile(now.counts[stage], before.counts[stage], total, q);
+        }
+        std::cout << std::endl;
+      }
+      if(now.copies > before.copies){
+        // PRIMUS_VK_PERF_COUNTERS
+        const uint64_t copies = now.copies - before.copies;
+        std::cout << "  host copy per frame:";
+        for(uint32_t i = 0; i < PERF_COUNTER_COUNT; i++){
+          // Skips counters the kernel did not permit.
+          if(now.copy_counters[i] != 0){
+            std::cout << " " << (now.copy_counters[i] - before.copy_counters[i]) / copies << " " << perfCounterName(i);
+          }
+        }
+        const uint64_t cycles = now.copy_counters[PERF_CYCLES] - before.copy_counters[PERF_CYCLES];
+        if(cycles != 0){
+          std::cout << std::setprecision(2) << " IPC " << double(now.copy_counters[PERF_INSTRUCTIONS] - before.copy_counters[PERF_INSTRUCTIONS]) / cycles;
+        }
+        std::cout << std::endl;
+      }
+      before = now;
+    }
+  }
+  std::cout << self << "process " << pid << " exited" << std::endl;
+  return 0;
+}